@@ -0,0 +1,170 @@
+// Benchmarks for the pricing fast paths, kept out of options-cli because
+// they replace the global allocator to count heap allocations.
+//
+//   options-bench european [iterations]
+//   options-bench american [iterations]
+//
+// european times the allocation-free European closed form, checks it
+// against the QuantLib engine, checks that optionTypes other than call and
+// put are still rejected, and fails if the timed loop allocated. american
+// compares calcuateAmericanOption with and without one-shot pricing.
+
+#include "options.cpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+
+// Counts every heap allocation in the process.
+std::atomic<std::uint64_t> heapAllocations(0);
+
+void *operator new(std::size_t size) {
+  heapAllocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *memory = std::malloc(size ? size : 1))
+    return memory;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept { std::free(memory); }
+void operator delete(void *memory, std::size_t) noexcept { std::free(memory); }
+
+namespace
+{
+  int benchEuropean(Size iterations) {
+
+    optionParameters oP = parseOptionRequest(std::string(R"({
+      "executionStyle": 0, "optionType": -1,
+      "todaysDate": "1998-05-15", "settlementDate": "1998-05-17", "maturityDate": "1999-05-17",
+      "underlying": 36, "strike": 40, "dividendYield": 0.01, "riskFreeRate": 0.06, "optionPrice": 0.2
+    })"), nlohmann::detail::input_format_t::json);
+
+    optionGreeks greeks;
+    double thetaPerDay = 0.0;
+    if (!europeanClosedForm(oP, greeks, thetaPerDay)) {
+      cerr << "closed form declined the benchmark request" << endl;
+      return 1;
+    }
+
+    optionParameters reference = oP;
+    reference.request = json::object();
+    const json engine = analyticEuropeanOption(reference);
+    const double closedForm[] = { greeks.NPV, greeks.delta, greeks.gamma, greeks.vega,
+                                  greeks.theta, thetaPerDay, greeks.rho };
+    const char *names[] = { "NPV", "delta", "gamma", "vega", "theta", "thetaPerDay", "rho" };
+    double maxDifference = 0.0;
+    for (Size i = 0; i < 7; i++)
+      maxDifference = std::max(maxDifference,
+        std::fabs(closedForm[i] - engine[names[i]]["Black-Scholes"].get<double>()));
+
+    double checksum = 0.0;
+    const std::uint64_t allocationsBefore = heapAllocations.load();
+    const auto start = std::chrono::steady_clock::now();
+    for (Size i = 0; i < iterations; i++) {
+      oP.underlying = 36.0 + 1e-6 * double(i % 1000);
+      europeanClosedForm(oP, greeks, thetaPerDay);
+      checksum += greeks.NPV;
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const std::uint64_t allocations = heapAllocations.load() - allocationsBefore;
+
+    std::cout << "european closed form: "
+              << std::chrono::duration<double, std::nano>(elapsed).count() / double(std::max<Size>(iterations, 1))
+              << " ns/call, " << allocations << " allocations in " << iterations << " calls, "
+              << "max difference from AnalyticEuropeanEngine " << maxDifference
+              << " (checksum " << checksum << ")" << endl;
+
+    if (allocations != 0) {
+      cerr << "closed form allocated" << endl;
+      return 1;
+    }
+    if (maxDifference > 1e-10) {
+      cerr << "closed form disagrees with AnalyticEuropeanEngine" << endl;
+      return 1;
+    }
+
+    // Only calls and puts are priced; anything else must still be an error,
+    // both from the parser and from the closed form itself.
+    for (int type : { 0, 7 }) {
+      optionParameters invalid = oP;
+      invalid.type = Option::Type(type);
+      if (europeanClosedForm(invalid, greeks, thetaPerDay)) {
+        cerr << "closed form priced optionType " << type << endl;
+        return 1;
+      }
+      const std::string response = calcuateOption(R"({
+        "executionStyle": 0, "optionType": )" + std::to_string(type) + R"(,
+        "todaysDate": "1998-05-15", "settlementDate": "1998-05-17", "maturityDate": "1999-05-17",
+        "underlying": 36, "strike": 40, "dividendYield": 0.01, "riskFreeRate": 0.06, "optionPrice": 0.2
+      })");
+      if (response.empty() || response[0] == '{') {
+        cerr << "optionType " << type << " was priced" << endl;
+        return 1;
+      }
+    }
+    return 0;
+  };
+
+  // Times calcuateAmericanOption with observer notifications on and then in
+  // one-shot mode, and fails if the two disagree.
+  int benchAmerican(Size iterations) {
+
+    const optionParameters request = parseOptionRequest(std::string(R"({
+      "executionStyle": 1, "optionType": -1,
+      "todaysDate": "1998-05-15", "settlementDate": "1998-05-17", "maturityDate": "1999-05-17",
+      "underlying": 36, "strike": 40, "dividendYield": 0.01, "riskFreeRate": 0.06, "optionPrice": 0.2
+    })"), nlohmann::detail::input_format_t::json);
+
+    double nanoseconds[2];
+    std::uint64_t allocations[2];
+    std::string results[2];
+    for (int oneShot = 0; oneShot < 2; oneShot++) {
+      setOneShotPricing(oneShot != 0);
+      const std::uint64_t allocationsBefore = heapAllocations.load();
+      const auto start = std::chrono::steady_clock::now();
+      for (Size i = 0; i < iterations; i++) {
+        arenaScope scope;
+        optionParameters oP = request;
+        oP.request = json::object();
+        const json result = calcuateAmericanOption(oP);
+        if (i == 0)
+          results[oneShot] = result.dump();
+      }
+      const auto elapsed = std::chrono::steady_clock::now() - start;
+      nanoseconds[oneShot] = std::chrono::duration<double, std::nano>(elapsed).count()
+                             / double(std::max<Size>(iterations, 1));
+      allocations[oneShot] = heapAllocations.load() - allocationsBefore;
+    }
+    setOneShotPricing(false);
+
+    const char *modes[] = { "notifying", "one-shot" };
+    for (int oneShot = 0; oneShot < 2; oneShot++)
+      std::cout << "american " << modes[oneShot] << ": " << nanoseconds[oneShot] / 1000.0
+                << " us/request, " << allocations[oneShot] << " heap allocations in "
+                << iterations << " requests" << endl;
+    std::cout << "one-shot speedup " << nanoseconds[0] / nanoseconds[1] << "x" << endl;
+
+    if (results[0] != results[1]) {
+      cerr << "one-shot results differ from notifying results" << endl;
+      return 1;
+    }
+    return 0;
+  };
+}
+
+int main(int argc, char* argv[]) {
+
+  const std::string command = argc > 1 ? argv[1] : "";
+  try {
+    if (command == "european")
+      return benchEuropean(argc > 2 ? std::stoul(argv[2]) : 1000000);
+    if (command == "american")
+      return benchAmerican(argc > 2 ? std::stoul(argv[2]) : 100);
+  }
+  catch (std::exception &e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+
+  cerr << "usage: options-bench european|american [iterations]" << endl;
+  return 1;
+}
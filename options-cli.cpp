@@ -0,0 +1,578 @@
+// Native command line front end for batch work.
+//
+//   options-cli ndjson [file] [--workers n] [--queue n]
+//   options-cli columnar price <input.col> <output.col> [--workers n]
+//   options-cli columnar from-ndjson|from-csv <input> <output.col>
+//   options-cli columnar to-ndjson|to-csv <file.col>
+//
+// ndjson reads one calcuateOption request per line from the file (or stdin),
+// prices lines on a worker pool and writes one result per line to stdout in
+// input order. Errors are written as {"error": "..."} so the output stays
+// valid NDJSON.
+//
+// columnar files are a small header followed by one fixed-width column per
+// field; see columnarHeader below. "price" maps an input file and writes
+// results straight into a mapped output file without any JSON.
+
+#include "options.cpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+  struct ndjsonLine {
+    Size sequence;
+    std::string text;
+  };
+
+  // Lines flow reader -> bounded queue -> workers -> reorder buffer -> stdout.
+  // The reader also waits while too many lines are unwritten, so a single
+  // slow line cannot make the reorder buffer grow without bound.
+  int runNdjson(std::istream &input, Size workers, Size queueSize) {
+
+    boundedQueue<ndjsonLine> lines(queueSize);
+    const Size window = queueSize + 2 * workers;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::map<Size, std::string> finished;
+    Size written = 0, total = 0;
+    bool readerDone = false;
+
+    std::thread reader([&]() {
+      std::string text;
+      Size sequence = 0;
+      while (std::getline(input, text)) {
+        if (text.find_first_not_of(" \t\r") == std::string::npos)
+          continue;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          changed.wait(lock, [&]() { return sequence - written < window; });
+        }
+        lines.push(ndjsonLine{sequence++, std::move(text)});
+      }
+      lines.close();
+      std::lock_guard<std::mutex> lock(mutex);
+      total = sequence;
+      readerDone = true;
+      changed.notify_all();
+    });
+
+    std::vector<std::thread> pool;
+    for (Size i = 0; i < workers; i++)
+      pool.emplace_back([&]() {
+        ndjsonLine line;
+        while (lines.pop(line)) {
+          std::string result = calcuateOption(line.text);
+          if (result.empty() || result[0] != '{') {
+            json error;
+            error["error"] = result;
+            result = error.dump();
+          }
+          std::lock_guard<std::mutex> lock(mutex);
+          finished[line.sequence] = std::move(result);
+          changed.notify_all();
+        }
+      });
+
+    for (;;) {
+      std::string result;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() {
+          return finished.count(written) || (readerDone && written == total); });
+        if (readerDone && written == total)
+          break;
+        auto next = finished.find(written);
+        result = std::move(next->second);
+        finished.erase(next);
+        written++;
+        changed.notify_all();
+      }
+      std::cout << result << '\n';
+    }
+    std::cout.flush();
+
+    reader.join();
+    for (auto &t : pool)
+      t.join();
+    return 0;
+  };
+
+  // File layout, all little-endian:
+  //   columnarHeader
+  //   columnarColumn[columns]
+  //   column data, each column 8-byte aligned at its offset
+  // Dates are int32 yyyymmdd. Input files carry the calcuateOption fields;
+  // output files have one float64 column per result, named "greek:engine"
+  // for the per-engine maps, NaN where a row has no such result, and an
+  // int32 "error" column that is 1 for rows that failed to price.
+  const char columnarMagic[8] = { 'O', 'P', 'T', 'C', 'O', 'L', '1', 0 };
+
+  enum columnType : uint32_t { float64Column = 0, int32Column = 1 };
+
+  struct columnarHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t columns;
+    uint64_t rows;
+  };
+
+  struct columnarColumn {
+    char name[48];
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t offset;
+  };
+
+  const std::vector<std::pair<std::string, columnType> > &inputColumns(){
+    static const std::vector<std::pair<std::string, columnType> > columns = {
+      { "executionStyle", int32Column },
+      { "optionType", int32Column },
+      { "todaysDate", int32Column },
+      { "settlementDate", int32Column },
+      { "maturityDate", int32Column },
+      { "underlying", float64Column },
+      { "strike", float64Column },
+      { "dividendYield", float64Column },
+      { "riskFreeRate", float64Column },
+      { "optionPrice", float64Column } };
+    return columns;
+  };
+
+  bool isDateColumn(const std::string &name){
+    return name.size() > 4 && name.compare(name.size() - 4, 4, "Date") == 0;
+  };
+
+  int32_t dateToColumn(const Date &date){
+    return date.year() * 10000 + int(date.month()) * 100 + date.dayOfMonth();
+  };
+
+  Date columnToDate(int32_t value){
+    return Date(Day(value % 100), Month(value / 100 % 100), Year(value / 10000));
+  };
+
+  std::string columnToIso(int32_t value){
+    // Sized for any int32_t, not only yyyymmdd, so snprintf never truncates.
+    char text[24];
+    std::snprintf(text, sizeof(text), "%04d-%02d-%02d", value / 10000, value / 100 % 100, value % 100);
+    return text;
+  };
+
+  struct columnarFile {
+    int fd = -1;
+    char *data = nullptr;
+    Size size = 0;
+
+    ~columnarFile() {
+      if (data)
+        ::munmap(data, size);
+      if (fd >= 0)
+        ::close(fd);
+    }
+
+    const columnarHeader &header() const { return *reinterpret_cast<const columnarHeader*>(data); }
+
+    columnarColumn *columns() const {
+      return reinterpret_cast<columnarColumn*>(data + sizeof(columnarHeader));
+    }
+
+    void *column(const std::string &name, columnType type) const {
+      for (uint32_t i = 0; i < header().columns; i++)
+        if (name == columns()[i].name) {
+          QL_REQUIRE(columns()[i].type == type, "column " << name << " has the wrong type");
+          return data + columns()[i].offset;
+        }
+      QL_FAIL("missing column " << name);
+    }
+
+    const double *float64(const std::string &name) const {
+      return static_cast<const double*>(column(name, float64Column));
+    }
+
+    const int32_t *int32(const std::string &name) const {
+      return static_cast<const int32_t*>(column(name, int32Column));
+    }
+
+    void open(const std::string &path) {
+      fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      QL_REQUIRE(fd >= 0, "cannot open " << path);
+      struct stat info;
+      QL_REQUIRE(::fstat(fd, &info) == 0, "cannot stat " << path);
+      size = info.st_size;
+      QL_REQUIRE(size >= sizeof(columnarHeader), path << " is not a columnar file");
+      data = static_cast<char*>(::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0));
+      QL_REQUIRE(data != MAP_FAILED, "cannot map " << path);
+      QL_REQUIRE(std::memcmp(header().magic, columnarMagic, sizeof(columnarMagic)) == 0
+                 && header().version == 1, path << " is not a columnar file");
+      Size end = sizeof(columnarHeader) + Size(header().columns) * sizeof(columnarColumn);
+      QL_REQUIRE(end <= size, path << " is truncated");
+      for (uint32_t i = 0; i < header().columns; i++) {
+        const columnarColumn &c = columns()[i];
+        QL_REQUIRE(std::memchr(c.name, 0, sizeof(c.name)), path << " has an unterminated column name");
+        QL_REQUIRE(c.type == float64Column || c.type == int32Column,
+                   path << " has column " << c.name << " of unknown type");
+        // Columns are read in place as double and int32_t arrays, and the
+        // mapping is page aligned.
+        QL_REQUIRE(c.offset % 8 == 0, path << " has misaligned column " << c.name);
+        // Divided rather than multiplied, so that no rows or offset can wrap.
+        const Size width = c.type == float64Column ? 8 : 4;
+        QL_REQUIRE(c.offset <= size && header().rows <= (size - c.offset) / width,
+                   path << " is truncated");
+      }
+    }
+
+    void create(const std::string &path,
+                const std::vector<std::pair<std::string, columnType> > &layout,
+                Size rows) {
+      size = sizeof(columnarHeader) + layout.size() * sizeof(columnarColumn);
+      std::vector<uint64_t> offsets;
+      for (auto &c : layout) {
+        size = (size + 7) / 8 * 8;
+        offsets.push_back(size);
+        size += rows * (c.second == float64Column ? 8 : 4);
+      }
+
+      fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      QL_REQUIRE(fd >= 0, "cannot create " << path);
+      QL_REQUIRE(::ftruncate(fd, size) == 0, "cannot size " << path);
+      data = static_cast<char*>(::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+      QL_REQUIRE(data != MAP_FAILED, "cannot map " << path);
+
+      columnarHeader &h = *reinterpret_cast<columnarHeader*>(data);
+      std::memcpy(h.magic, columnarMagic, sizeof(columnarMagic));
+      h.version = 1;
+      h.columns = layout.size();
+      h.rows = rows;
+      for (Size i = 0; i < layout.size(); i++) {
+        QL_REQUIRE(layout[i].first.size() < sizeof(columnarColumn::name),
+                   "column name " << layout[i].first << " is too long");
+        std::strcpy(columns()[i].name, layout[i].first.c_str());
+        columns()[i].type = layout[i].second;
+        columns()[i].offset = offsets[i];
+      }
+    }
+  };
+
+  // Column pointers of an input file, looked up once.
+  struct columnarInput {
+    const int32_t *executionStyle, *optionType, *todaysDate, *settlementDate, *maturityDate;
+    const double *underlying, *strike, *dividendYield, *riskFreeRate, *optionPrice;
+
+    explicit columnarInput(const columnarFile &file)
+    : executionStyle(file.int32("executionStyle")), optionType(file.int32("optionType")),
+      todaysDate(file.int32("todaysDate")), settlementDate(file.int32("settlementDate")),
+      maturityDate(file.int32("maturityDate")), underlying(file.float64("underlying")),
+      strike(file.float64("strike")), dividendYield(file.float64("dividendYield")),
+      riskFreeRate(file.float64("riskFreeRate")), optionPrice(file.float64("optionPrice")) {}
+
+    optionParameters row(Size i) const {
+      optionParameters oP;
+      oP.executionStyle = executionStyle[i];
+      oP.type = Option::Type(optionType[i]);
+      oP.todaysDate = columnToDate(todaysDate[i]);
+      oP.settlementDate = columnToDate(settlementDate[i]);
+      oP.maturityDate = columnToDate(maturityDate[i]);
+      oP.underlying = underlying[i];
+      oP.strike = strike[i];
+      oP.dividendYield = dividendYield[i];
+      oP.riskFreeRate = riskFreeRate[i];
+      oP.optionPrice = optionPrice[i];
+      oP.timeSteps = 801;
+      oP.request = json::object();
+      return oP;
+    }
+  };
+
+  std::string columnName(const resultName &result){
+    return result.second ? std::string(result.first) + ":" + result.second : std::string(result.first);
+  };
+
+  // Writes one row's results straight into the output columns of its
+  // execution style. Results are matched by name with a short scan, so
+  // pricing a row builds no JSON and allocates no keys.
+  struct columnSink : resultSink {
+    struct slot {
+      resultName name;
+      double *values;
+    };
+    const std::vector<slot> *slots;
+    Size row;
+
+    void record(const char *field, const char *engine, double value) {
+      for (const slot &s : *slots)
+        if (std::strcmp(s.name.first, field) == 0 && (s.name.second == engine
+            || (s.name.second && engine && std::strcmp(s.name.second, engine) == 0))) {
+          s.values[row] = value;
+          return;
+        }
+    }
+  };
+
+  // The output schema is the union of resultNames() over the execution
+  // styles present in the input, so it is known without pricing anything;
+  // the whole output file is laid out up front and workers fill their rows
+  // in place. Rows of a style priceOption rejects only set the error flag.
+  int priceColumnar(const std::string &inputPath, const std::string &outputPath, Size workers) {
+
+    columnarFile file;
+    file.open(inputPath);
+    const Size rows = file.header().rows;
+    const columnarInput input(file);
+
+    std::map<int32_t, std::vector<resultName> > styles;
+    for (Size row = 0; row < rows; row++)
+      if (!styles.count(input.executionStyle[row]))
+        styles[input.executionStyle[row]] = resultNames(input.executionStyle[row]);
+
+    std::vector<std::string> names;
+    for (auto &style : styles)
+      for (auto &result : style.second)
+        names.push_back(columnName(result));
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+
+    std::vector<std::pair<std::string, columnType> > layout;
+    for (auto &name : names)
+      layout.push_back(std::make_pair(name, float64Column));
+    layout.push_back(std::make_pair(std::string("error"), int32Column));
+
+    columnarFile output;
+    output.create(outputPath, layout, rows);
+    std::vector<double*> columns;
+    for (auto &name : names)
+      columns.push_back(const_cast<double*>(output.float64(name)));
+    int32_t *errors = const_cast<int32_t*>(output.int32("error"));
+
+    std::map<int32_t, std::vector<columnSink::slot> > slots;
+    for (auto &style : styles) {
+      std::vector<columnSink::slot> &styleSlots = slots[style.first];
+      for (auto &result : style.second)
+        styleSlots.push_back(columnSink::slot{ result,
+          const_cast<double*>(output.float64(columnName(result))) });
+    }
+
+    std::atomic<Size> failed(0);
+    parallelFor(rows, [&](Size row) {
+      for (double *column : columns)
+        column[row] = std::numeric_limits<double>::quiet_NaN();
+      try {
+        arenaScope scope;
+        columnSink sink;
+        sink.slots = &slots.at(input.executionStyle[row]);
+        sink.row = row;
+        optionParameters oP = input.row(row);
+        oP.sink = &sink;
+        priceOption(oP);
+        errors[row] = 0;
+      }
+      catch (...) {
+        errors[row] = 1;
+        failed++;
+      }
+    }, workers);
+
+    if (failed)
+      cerr << failed << " of " << rows << " rows failed to price" << endl;
+    return 0;
+  };
+
+  void writeInputRow(columnarFile &output, Size row, const json &request){
+    for (auto &c : inputColumns()) {
+      const json &value = request.at(c.first);
+      if (isDateColumn(c.first))
+        const_cast<int32_t*>(output.int32(c.first))[row] =
+          dateToColumn(DateParser::parseISO(value.get<std::string>()));
+      else if (c.second == int32Column)
+        const_cast<int32_t*>(output.int32(c.first))[row] = value.get<int32_t>();
+      else
+        const_cast<double*>(output.float64(c.first))[row] = value.get<double>();
+    }
+  };
+
+  std::vector<std::string> splitCsv(const std::string &line){
+    std::vector<std::string> fields;
+    std::string::size_type start = 0, comma;
+    while ((comma = line.find(',', start)) != std::string::npos) {
+      fields.push_back(line.substr(start, comma - start));
+      start = comma + 1;
+    }
+    fields.push_back(line.substr(start));
+    for (auto &f : fields) {
+      f.erase(0, f.find_first_not_of(" \t\r\""));
+      f.erase(f.find_last_not_of(" \t\r\"") + 1);
+    }
+    return fields;
+  };
+
+  // Both converters read the input twice: once to count rows so the output
+  // can be laid out, then again to fill it.
+  int convertToColumnar(const std::string &format, const std::string &inputPath, const std::string &outputPath) {
+
+    std::ifstream counting(inputPath);
+    QL_REQUIRE(counting, "cannot open " << inputPath);
+    std::string line;
+    Size rows = 0;
+    while (std::getline(counting, line))
+      if (line.find_first_not_of(" \t\r") != std::string::npos)
+        rows++;
+    if (format == "csv" && rows > 0)
+      rows--;
+
+    columnarFile output;
+    output.create(outputPath, inputColumns(), rows);
+
+    std::ifstream input(inputPath);
+    std::vector<std::string> header;
+    Size row = 0;
+    while (std::getline(input, line) && row < rows) {
+      if (line.find_first_not_of(" \t\r") == std::string::npos)
+        continue;
+      if (format == "ndjson") {
+        writeInputRow(output, row++, json::parse(line));
+      } else if (header.empty()) {
+        header = splitCsv(line);
+      } else {
+        std::vector<std::string> fields = splitCsv(line);
+        QL_REQUIRE(fields.size() == header.size(), "row " << row + 1 << " has " << fields.size() << " fields");
+        json request;
+        for (Size i = 0; i < header.size(); i++) {
+          if (isDateColumn(header[i]))
+            request[header[i]] = fields[i];
+          else
+            request[header[i]] = std::stod(fields[i]);
+        }
+        for (auto &c : inputColumns())
+          if (c.second == int32Column && !isDateColumn(c.first))
+            request[c.first] = int32_t(request.at(c.first).get<double>());
+        writeInputRow(output, row++, request);
+      }
+    }
+    return 0;
+  };
+
+  int convertFromColumnar(const std::string &format, const std::string &inputPath) {
+
+    columnarFile input;
+    input.open(inputPath);
+    const columnarHeader &header = input.header();
+    const columnarColumn *columns = input.columns();
+
+    if (format == "csv") {
+      for (uint32_t c = 0; c < header.columns; c++)
+        std::cout << (c ? "," : "") << columns[c].name;
+      std::cout << '\n';
+    }
+
+    for (Size row = 0; row < header.rows; row++) {
+      json record;
+      for (uint32_t c = 0; c < header.columns; c++) {
+        const std::string name = columns[c].name;
+        std::string text;
+        json value;
+        const char *column = input.data + columns[c].offset;
+        if (columns[c].type == int32Column) {
+          int32_t v = reinterpret_cast<const int32_t*>(column)[row];
+          if (isDateColumn(name)) {
+            text = columnToIso(v);
+            value = text;
+          } else {
+            text = std::to_string(v);
+            value = v;
+          }
+        } else {
+          double v = reinterpret_cast<const double*>(column)[row];
+          if (!std::isnan(v)) {
+            value = v;
+            text = value.dump();
+          }
+        }
+
+        if (format == "csv") {
+          std::cout << (c ? "," : "") << text;
+        } else if (!value.is_null()) {
+          std::string::size_type colon = name.find(':');
+          if (colon == std::string::npos)
+            record[name] = value;
+          else
+            record[name.substr(0, colon)][name.substr(colon + 1)] = value;
+        }
+      }
+      if (format == "csv")
+        std::cout << '\n';
+      else
+        std::cout << record.dump() << '\n';
+    }
+    std::cout.flush();
+    return 0;
+  };
+}
+
+int main(int argc, char* argv[]) {
+
+  std::ios::sync_with_stdio(false);
+
+  std::vector<std::string> arguments(argv + 1, argv + argc);
+  std::vector<std::string> positional;
+  Size workers = std::max(1u, std::thread::hardware_concurrency());
+  Size queueSize = 4096;
+
+  for (Size i = 0; i < arguments.size(); i++) {
+    if (arguments[i] == "--workers" && i + 1 < arguments.size())
+      workers = std::stoul(arguments[++i]);
+    else if (arguments[i] == "--queue" && i + 1 < arguments.size())
+      queueSize = std::stoul(arguments[++i]);
+    else
+      positional.push_back(arguments[i]);
+  }
+
+  if (positional.empty()) {
+    cerr << "usage: options-cli ndjson [file] [--workers n] [--queue n]" << endl
+         << "       options-cli columnar price <input.col> <output.col> [--workers n]" << endl
+         << "       options-cli columnar from-ndjson|from-csv <input> <output.col>" << endl
+         << "       options-cli columnar to-ndjson|to-csv <file.col>" << endl;
+    return 1;
+  }
+
+  if (positional[0] == "ndjson") {
+    // Calibrated here rather than by the first line with a deadline.
+    warmUp();
+    if (positional.size() > 1 && positional[1] != "-") {
+      std::ifstream file(positional[1]);
+      if (!file) {
+        cerr << "cannot open " << positional[1] << endl;
+        return 1;
+      }
+      return runNdjson(file, workers, queueSize);
+    }
+    return runNdjson(std::cin, workers, queueSize);
+  }
+
+  if (positional[0] == "columnar" && positional.size() > 2) {
+    try {
+      const std::string &command = positional[1];
+      if (command == "price" && positional.size() > 3)
+        return priceColumnar(positional[2], positional[3], workers);
+      if ((command == "from-ndjson" || command == "from-csv") && positional.size() > 3)
+        return convertToColumnar(command.substr(5), positional[2], positional[3]);
+      if (command == "to-ndjson" || command == "to-csv")
+        return convertFromColumnar(command.substr(3), positional[2]);
+    }
+    catch (std::exception &e) {
+      cerr << e.what() << endl;
+      return 1;
+    }
+  }
+
+  cerr << "unknown command " << positional[0] << endl;
+  return 1;
+}
@@ -0,0 +1,397 @@
+// Long-running native pricer on a Unix domain socket.
+//
+// Every frame, in both directions, is a 4-byte big-endian length followed by
+// that many bytes of payload. A request payload is a calcuateOption request as
+// JSON text, CBOR or MessagePack; the encoding is told apart by the first byte
+// (a map header in either binary format never looks like '{') and the reply
+// uses the same encoding. Clients may pipeline any number of requests on one
+// connection; replies come back in request order.
+//
+//   options-daemon [--socket path] [--workers n] [--queue n] [--cache n]
+//                  [--metrics path]
+//
+// With --metrics the Prometheus text from getMetrics() is rewritten to path
+// once a second, for a node_exporter textfile collector or similar.
+//
+// A {"cancel": "<requestId>"} JSON frame cancels the requests in flight
+// under that requestId. It is handled as soon as it is read rather than
+// queued, and its reply, in order like any other, is {"cancelled": true}
+// if there was anything to cancel. A {"loadYieldCurve": {...}} frame is
+// handled the same way, so requests after it on the connection can name the
+// curve; its reply is loadYieldCurve's.
+
+#include "options.cpp"
+
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <set>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+  const Size maxFrameSize = 64 * 1024 * 1024;
+  // Unparsed input kept per connection: room for one frame of the largest
+  // size. Anything past it waits in the socket.
+  const Size maxBufferedInput = maxFrameSize + 4;
+
+  volatile std::sig_atomic_t stopRequested = 0;
+
+  void requestStop(int) { stopRequested = 1; };
+
+  std::string calcuateFrame(const std::string &payload) {
+    const unsigned char first = payload.empty() ? 0 : payload[0];
+    const bool cbor = first >= 0xa0 && first <= 0xbf;
+    const bool msgpack = (first >= 0x80 && first <= 0x8f) || first == 0xde || first == 0xdf;
+    if (!cbor && !msgpack)
+      return calcuateOption(payload);
+
+    std::vector<std::uint8_t> reply = calcuateOptionBinary(
+      std::vector<std::uint8_t>(payload.begin(), payload.end()),
+      cbor ? binaryEncoding::cbor : binaryEncoding::msgpack);
+    return std::string(reply.begin(), reply.end());
+  };
+
+  bool cancelFrame(const std::string &payload, std::string &reply) {
+    if (payload.empty() || payload[0] != '{' || payload.find("\"cancel\"") == std::string::npos)
+      return false;
+    const json frame = json::parse(payload, nullptr, false);
+    if (!frame.is_object() || frame.size() != 1 || !frame.contains("cancel") || !frame["cancel"].is_string())
+      return false;
+    json result = json::object();
+    result["cancelled"] = cancel(frame["cancel"].get<std::string>());
+    reply = result.dump();
+    return true;
+  };
+
+  bool curveFrame(const std::string &payload, std::string &reply) {
+    if (payload.empty() || payload[0] != '{' || payload.find("\"loadYieldCurve\"") == std::string::npos)
+      return false;
+    const json frame = json::parse(payload, nullptr, false);
+    if (!frame.is_object() || frame.size() != 1 || !frame.contains("loadYieldCurve")
+        || !frame["loadYieldCurve"].is_object())
+      return false;
+    reply = loadYieldCurve(frame["loadYieldCurve"].dump());
+    return true;
+  };
+
+  struct daemonJob {
+    unsigned long long connection;
+    unsigned long long sequence;
+    std::string payload;
+  };
+
+  struct daemonConnection {
+    int fd = -1;
+    std::string input;
+    Size consumed = 0;
+    std::string output;
+    Size written = 0;
+    unsigned long long nextSequence = 0;
+    unsigned long long nextReply = 0;
+    std::map<unsigned long long, std::string> ready;
+    std::uint32_t events = EPOLLIN;
+    // The client has shut down its side; the connection is dropped once
+    // every frame it sent has been answered.
+    bool peerClosed = false;
+  };
+
+  // Epoll events carry a connection id rather than a descriptor; ids are
+  // never reused, so replies for a connection that has gone away are simply
+  // discarded even if its descriptor number has been handed out again.
+  const unsigned long long listenerId = 0, wakeupId = 1;
+
+  struct daemonServer {
+    int listener = -1;
+    int epoll = -1;
+    int wakeup = -1;
+    unsigned long long nextId = 2;
+    std::map<unsigned long long, daemonConnection> connections;
+    std::set<unsigned long long> stalled;
+    boundedQueue<daemonJob> jobs;
+    std::mutex completedMutex;
+    std::vector<daemonJob> completed;
+
+    explicit daemonServer(Size queueSize) : jobs(queueSize) {}
+
+    // Reads while the client may still send and the connection is not
+    // stalled on a full job queue, and writes while replies are pending.
+    void watch(unsigned long long id, daemonConnection &c) {
+      const std::uint32_t events = (c.peerClosed || stalled.count(id) ? 0u : std::uint32_t(EPOLLIN))
+                                 | (c.output.empty() ? 0u : std::uint32_t(EPOLLOUT));
+      if (events == c.events)
+        return;
+      c.events = events;
+      epoll_event event = {};
+      event.events = events;
+      event.data.u64 = id;
+      epoll_ctl(epoll, EPOLL_CTL_MOD, c.fd, &event);
+    }
+
+    void drop(unsigned long long id) {
+      auto found = connections.find(id);
+      if (found == connections.end())
+        return;
+      epoll_ctl(epoll, EPOLL_CTL_DEL, found->second.fd, nullptr);
+      ::close(found->second.fd);
+      connections.erase(found);
+      stalled.erase(id);
+    }
+
+    // Queues every complete frame in the input buffer, answering cancel
+    // and loadYieldCurve frames directly. Stops early when the job queue is
+    // full; the connection is then not read from until workers catch up
+    // and collect() retries it.
+    bool readFrames(unsigned long long id, daemonConnection &c) {
+      stalled.erase(id);
+      while (c.input.size() - c.consumed >= 4) {
+        const unsigned char *header =
+          reinterpret_cast<const unsigned char*>(c.input.data() + c.consumed);
+        const Size length = (Size(header[0]) << 24) | (Size(header[1]) << 16)
+                          | (Size(header[2]) << 8) | Size(header[3]);
+        if (length > maxFrameSize)
+          return false;
+        if (c.input.size() - c.consumed < 4 + length)
+          break;
+        daemonJob job{id, c.nextSequence, c.input.substr(c.consumed + 4, length)};
+        std::string reply;
+        if (cancelFrame(job.payload, reply) || curveFrame(job.payload, reply)) {
+          c.ready[c.nextSequence++] = std::move(reply);
+          c.consumed += 4 + length;
+          continue;
+        }
+        if (!jobs.tryPush(job)) {
+          stalled.insert(id);
+          break;
+        }
+        c.nextSequence++;
+        c.consumed += 4 + length;
+      }
+      c.input.erase(0, c.consumed);
+      c.consumed = 0;
+      return writeReplies(id, c);
+    }
+
+    // Sends the replies that are due. Returns false when the connection
+    // should be dropped: on a write error, or once a half-closed connection
+    // has nothing left to answer.
+    bool writeReplies(unsigned long long id, daemonConnection &c) {
+      for (auto it = c.ready.begin(); it != c.ready.end() && it->first == c.nextReply; it = c.ready.erase(it)) {
+        const Size length = it->second.size();
+        const char header[4] = { char(length >> 24), char(length >> 16), char(length >> 8), char(length) };
+        c.output.append(header, 4);
+        c.output.append(it->second);
+        c.nextReply++;
+      }
+      while (c.written < c.output.size()) {
+        ssize_t n = ::send(c.fd, c.output.data() + c.written, c.output.size() - c.written, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+          break;
+        if (n <= 0)
+          return false;
+        c.written += n;
+      }
+      if (c.written == c.output.size()) {
+        c.output.clear();
+        c.written = 0;
+      }
+      watch(id, c);
+      return !c.peerClosed || stalled.count(id) || c.nextReply != c.nextSequence || !c.output.empty();
+    }
+
+    void accept() {
+      for (;;) {
+        int fd = ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+          return;
+        const unsigned long long id = nextId++;
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = id;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event);
+        connections[id].fd = fd;
+      }
+    }
+
+    void receive(unsigned long long id) {
+      auto found = connections.find(id);
+      if (found == connections.end())
+        return;
+      daemonConnection &c = found->second;
+      // Reading has stopped, so only a hangup or an error gets here: the
+      // client is gone and its replies cannot be delivered.
+      if (c.peerClosed) {
+        drop(id);
+        return;
+      }
+      char buffer[65536];
+      while (c.input.size() < maxBufferedInput) {
+        ssize_t n = ::recv(c.fd, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+          c.input.append(buffer, n);
+          continue;
+        }
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+          break;
+        if (n < 0) {
+          drop(id);
+          return;
+        }
+        c.peerClosed = true;
+        break;
+      }
+      if (!readFrames(id, c))
+        drop(id);
+    }
+
+    void collect() {
+      uint64_t count;
+      while (::read(wakeup, &count, sizeof(count)) > 0) {}
+
+      std::vector<daemonJob> done;
+      {
+        std::lock_guard<std::mutex> lock(completedMutex);
+        done.swap(completed);
+      }
+      for (auto &job : done) {
+        auto found = connections.find(job.connection);
+        if (found == connections.end())
+          continue;
+        found->second.ready[job.sequence] = std::move(job.payload);
+        if (!writeReplies(job.connection, found->second))
+          drop(job.connection);
+      }
+
+      std::vector<unsigned long long> retry(stalled.begin(), stalled.end());
+      for (auto id : retry) {
+        auto found = connections.find(id);
+        if (found != connections.end() && !readFrames(id, found->second))
+          drop(id);
+      }
+    }
+
+    void work() {
+      daemonJob job;
+      while (jobs.pop(job)) {
+        job.payload = calcuateFrame(job.payload);
+        {
+          std::lock_guard<std::mutex> lock(completedMutex);
+          completed.push_back(std::move(job));
+        }
+        uint64_t one = 1;
+        ssize_t ignored = ::write(wakeup, &one, sizeof(one));
+        (void)ignored;
+      }
+    }
+  };
+}
+
+int main(int argc, char* argv[]) {
+
+  std::string socketPath = "/tmp/options-daemon.sock";
+  Size workers = std::max(1u, std::thread::hardware_concurrency());
+  Size queueSize = 1024;
+  Size cacheSize = 0;
+  std::string metricsPath;
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string option = argv[i];
+    if (option == "--socket") socketPath = argv[i + 1];
+    else if (option == "--workers") workers = std::stoul(argv[i + 1]);
+    else if (option == "--queue") queueSize = std::stoul(argv[i + 1]);
+    else if (option == "--cache") cacheSize = std::stoul(argv[i + 1]);
+    else if (option == "--metrics") metricsPath = argv[i + 1];
+    else {
+      cerr << "unknown option " << option << endl;
+      return 1;
+    }
+  }
+
+  setCacheCapacity(cacheSize);
+  // Calibrated here rather than by the first request with a deadline.
+  warmUp();
+
+  daemonServer server(queueSize);
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    cerr << "socket path too long" << endl;
+    return 1;
+  }
+  std::strcpy(address.sun_path, socketPath.c_str());
+  ::unlink(socketPath.c_str());
+
+  server.listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (server.listener < 0
+      || ::bind(server.listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0
+      || ::listen(server.listener, SOMAXCONN) < 0) {
+    cerr << "cannot listen on " << socketPath << ": " << std::strerror(errno) << endl;
+    return 1;
+  }
+
+  server.epoll = ::epoll_create1(EPOLL_CLOEXEC);
+  server.wakeup = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  for (auto watched : { std::make_pair(server.listener, listenerId), std::make_pair(server.wakeup, wakeupId) }) {
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = watched.second;
+    epoll_ctl(server.epoll, EPOLL_CTL_ADD, watched.first, &event);
+  }
+
+  std::signal(SIGINT, requestStop);
+  std::signal(SIGTERM, requestStop);
+  std::signal(SIGPIPE, SIG_IGN);
+
+  std::vector<std::thread> pool;
+  for (Size i = 0; i < workers; i++)
+    pool.emplace_back([&server]() { server.work(); });
+
+  epoll_event events[256];
+  auto nextMetrics = std::chrono::steady_clock::now();
+  while (!stopRequested) {
+    if (!metricsPath.empty() && std::chrono::steady_clock::now() >= nextMetrics) {
+      if (!writeMetrics(metricsPath))
+        cerr << "cannot write metrics to " << metricsPath << endl;
+      nextMetrics += std::chrono::seconds(1);
+    }
+    int n = ::epoll_wait(server.epoll, events, 256, metricsPath.empty() ? -1 : 1000);
+    for (int i = 0; i < n; i++) {
+      const unsigned long long id = events[i].data.u64;
+      if (id == listenerId) {
+        server.accept();
+      } else if (id == wakeupId) {
+        server.collect();
+      } else {
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+          server.receive(id);
+        auto found = server.connections.find(id);
+        if (found != server.connections.end() && (events[i].events & EPOLLOUT)
+            && !server.writeReplies(id, found->second))
+          server.drop(id);
+      }
+    }
+  }
+
+  server.jobs.close();
+  for (auto &t : pool)
+    t.join();
+  while (!server.connections.empty())
+    server.drop(server.connections.begin()->first);
+  ::close(server.listener);
+  ::close(server.wakeup);
+  ::close(server.epoll);
+  ::unlink(socketPath.c_str());
+
+  return 0;
+}
@@ -1,8 +1,31 @@
+#ifdef __EMSCRIPTEN__
 #include <emscripten/bind.h>
+#include <emscripten/emscripten.h>
+#endif
 #include <malloc.h>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <string>
+#include <list>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <algorithm>
+#include <cmath>
+#include <thread>
 #include "ql/qldefines.hpp"
 #include <boost/config.hpp>
 #ifdef BOOST_MSVC
@@ -10,6 +33,7 @@
 #endif
 
 #include <ql/instruments/vanillaoption.hpp>
+#include <ql/cashflows/dividend.hpp>
 #include <ql/pricingengines/vanilla/binomialengine.hpp>
 #include <ql/pricingengines/vanilla/analyticeuropeanengine.hpp>
 #include <ql/pricingengines/vanilla/analytichestonengine.hpp>
@@ -21,431 +45,3564 @@
 #include <ql/pricingengines/vanilla/mceuropeanengine.hpp>
 #include <ql/pricingengines/vanilla/mcamericanengine.hpp>
 #include <ql/pricingengines/vanilla/analyticeuropeanvasicekengine.hpp>
+#include <ql/termstructures/yield/impliedtermstructure.hpp>
 #include <ql/time/calendars/target.hpp>
+#include <ql/time/calendars/nullcalendar.hpp>
+#include <ql/time/calendars/unitedstates.hpp>
+#include <ql/time/schedule.hpp>
 #include <ql/utilities/dataformatters.hpp>
 #include <ql/models/shortrate/onefactormodels/vasicek.hpp>
 #include <ql/time/date.hpp>
 #include <ql/utilities/dataparsers.hpp>
+#include <ql/pricingengines/blackcalculator.hpp>
+#include <ql/math/comparison.hpp>
+#include <ql/math/distributions/normaldistribution.hpp>
+#include <ql/methods/finitedifferences/meshers/fdmblackscholesmesher.hpp>
+#include <ql/methods/finitedifferences/meshers/fdmmeshercomposite.hpp>
+#include <ql/methods/finitedifferences/solvers/fdmblackscholessolver.hpp>
+#include <ql/methods/finitedifferences/stepconditions/fdmstepconditioncomposite.hpp>
+#include <ql/methods/finitedifferences/utilities/fdminnervaluecalculator.hpp>
 #include "json.hpp"
 
+// Native builds and wasm builds with -pthread can spread work over threads.
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define OPTIONS_THREADS 1
+#endif
+
+// Every instrument registers with the global evaluation date when built and
+// unregisters when destroyed, and threaded builds do both from many threads
+// at once. Stock QuantLib does not lock its observer lists, so these builds
+// need a QuantLib with per-thread sessions or the thread-safe observer
+// pattern.
+#if defined(OPTIONS_THREADS) && !defined(QL_ENABLE_SESSIONS) \
+    && !defined(QL_ENABLE_THREAD_SAFE_OBSERVER_PATTERN)
+#error threaded builds need QuantLib with QL_ENABLE_SESSIONS or QL_ENABLE_THREAD_SAFE_OBSERVER_PATTERN
+#endif
+
+// Define OPTIONS_ASYNCIFY in wasm builds linked with -sASYNCIFY to get the
+// Promise-returning calcuateOptionAsync export.
+#if defined(OPTIONS_ASYNCIFY) && !defined(__EMSCRIPTEN__)
+#error OPTIONS_ASYNCIFY needs an emscripten build with -sASYNCIFY
+#endif
+
 using namespace std;
+#ifdef __EMSCRIPTEN__
 using namespace emscripten;
+#endif
 using namespace QuantLib;
-using json = nlohmann::json;
 
-namespace
+#ifdef QL_ENABLE_SESSIONS
+// A QuantLib built with sessions keeps one Settings instance per session;
+// here every thread is its own session.
+namespace QuantLib {
+  ThreadKey sessionId() { return std::this_thread::get_id(); }
+}
+#endif
+
+// Named rather than anonymous: the allocator is a template argument of the
+// json type, which json.hpp instantiates outside this file.
+namespace optionsMemory
 {
-  struct optionParameters {
-    Date todaysDate;
-    QuantLib::Option::Type type;
-    double strike;
-    Date settlementDate;
-    Date maturityDate;
-    double underlying;
-    double optionPrice;
-    double dividendYield;
-    double riskFreeRate;
-    double timeSteps;
-    json request;
+  // Optional cap on the bytes one request may take from its arena; 0 is
+  // unlimited. Going over fails the request with requestMemoryExceeded.
+  std::atomic<std::size_t> &requestMemoryLimit(){
+    static std::atomic<std::size_t> limit(0);
+    return limit;
   };
 
-  std::string calcuateEuropeanOption(optionParameters &oP){
-
-    Calendar calendar = TARGET();
-    DayCounter dayCounter = Actual365Fixed();
-    Settings::instance().evaluationDate() = oP.todaysDate;
-    Volatility impliedVolatility(oP.optionPrice);
+  struct requestMemoryExceeded : std::bad_alloc {
+    const char *what() const noexcept override { return "request exceeded the memory limit"; }
+  };
 
-    oP.request["ImpliedVolatility"] = impliedVolatility;
+  // Per-thread monotonic arena for the short-lived objects of one request.
+  // Allocation bumps a pointer through a list of chunks and deallocation is
+  // free; when the outermost arenaScope on a thread ends with nothing left
+  // alive, the chunks are rewound for the next request. If something
+  // outlives its request (or is freed by another thread), the arena is
+  // handed over to the remaining allocations and released with the last of
+  // them, and the thread starts a fresh one.
+  class requestArena {
+    public:
+      ~requestArena() {
+        for (auto &chunk : chunks)
+          ::operator delete(chunk.first);
+      }
+
+      void *allocate(Size bytes) {
+        allocatedBlocks++;
+        allocatedBytes += bytes;
+        // Thrown once per request, so that unwinding and the error reply can
+        // still allocate.
+        const std::size_t limit = requestMemoryLimit().load(std::memory_order_relaxed);
+        if (limit && allocatedBytes > limit && !limitReached) {
+          limitReached = true;
+          throw requestMemoryExceeded();
+        }
+        for (; current < chunks.size(); current++, used = 0)
+          if (chunks[current].second - used >= bytes) {
+            void *memory = chunks[current].first + used;
+            used += bytes;
+            return memory;
+          }
+        const Size size = bytes > chunkSize ? bytes : chunkSize;
+        chunks.push_back(std::make_pair(static_cast<char*>(::operator new(size)), size));
+        used = bytes;
+        return chunks.back().first;
+      }
+
+      // One reference is held by the owning thread and one by every live
+      // allocation.
+      void retain() { references.fetch_add(1, std::memory_order_relaxed); }
+
+      void release() {
+        if (references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+          delete this;
+      }
+
+      bool idle() const { return references.load(std::memory_order_acquire) == 1; }
+
+      // Blocks and bytes handed out since the last call; owner thread only.
+      std::pair<Size, Size> takeCounts() {
+        std::pair<Size, Size> counts(allocatedBlocks, allocatedBytes);
+        allocatedBlocks = allocatedBytes = 0;
+        limitReached = false;
+        return counts;
+      }
+
+      void rewind() {
+        Size kept = 0, bytes = 0;
+        while (kept < chunks.size() && bytes + chunks[kept].second <= retainedBytes)
+          bytes += chunks[kept++].second;
+        for (Size i = std::max<Size>(kept, 1); i < chunks.size(); i++)
+          ::operator delete(chunks[i].first);
+        chunks.resize(std::min<Size>(chunks.size(), std::max<Size>(kept, 1)));
+        current = 0;
+        used = 0;
+      }
+
+    private:
+      static const Size chunkSize = 64 * 1024;
+      static const Size retainedBytes = 1024 * 1024;
+      std::vector<std::pair<char*, Size> > chunks;
+      Size current = 0;
+      Size used = 0;
+      Size allocatedBlocks = 0;
+      Size allocatedBytes = 0;
+      bool limitReached = false;
+      std::atomic<Size> references{1};
+  };
 
-    std::vector<Date> exerciseDates;
-    for (Integer i = 1; i <= 4; i++)
-      exerciseDates.push_back(oP.settlementDate + 3 * i * Months);
+  // Process-wide totals over finished arena scopes.
+  struct allocationTotals {
+    std::atomic<std::uint64_t> scopes{0};
+    std::atomic<std::uint64_t> blocks{0};
+    std::atomic<std::uint64_t> bytes{0};
+    std::atomic<std::uint64_t> lastBytes{0};
+    std::atomic<std::uint64_t> largestBytes{0};
+  };
 
-    ext::shared_ptr<Exercise> europeanExercise(
-      new EuropeanExercise(oP.maturityDate));
+  void raiseTo(std::atomic<std::uint64_t> &maximum, std::uint64_t value){
+    std::uint64_t seen = maximum.load(std::memory_order_relaxed);
+    while (value > seen && !maximum.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+  };
 
-    Handle<Quote> underlyingH(
-      ext::shared_ptr<Quote>(
-        new SimpleQuote(
-          oP.underlying)));
+  // malloc's view of the heap: bytes in use and bytes obtained from the
+  // system (in wasm, the latter never shrinks).
+  struct heapUsage {
+    std::uint64_t inUse;
+    std::uint64_t reserved;
+  };
 
-    Handle<YieldTermStructure> flatTermStructure(
-      ext::shared_ptr<YieldTermStructure>(
-        new FlatForward(
-          oP.settlementDate,
-          oP.riskFreeRate,
-          dayCounter)));
+  heapUsage currentHeap(){
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+#else
+    struct mallinfo info = mallinfo();
+#endif
+    heapUsage usage;
+    usage.inUse = std::uint64_t(info.uordblks) + std::uint64_t(info.hblkhd);
+    usage.reserved = std::uint64_t(info.arena) + std::uint64_t(info.hblkhd);
+    return usage;
+  };
 
-    Handle<YieldTermStructure> flatDividendTS(
-      ext::shared_ptr<YieldTermStructure>(
-        new FlatForward(
-          oP.settlementDate,
-          oP.dividendYield,
-          dayCounter)));
+  std::atomic<std::uint64_t> &peakHeapInUse(){
+    static std::atomic<std::uint64_t> peak(0);
+    return peak;
+  };
 
-    Handle<BlackVolTermStructure> flatVolTS(
-      ext::shared_ptr<BlackVolTermStructure>(
-        new BlackConstantVol(
-          oP.settlementDate,
-          calendar,
-          impliedVolatility, 
-          dayCounter)));
+  // mallinfo walks the allocator's bins, so the peak is sampled every
+  // heapSampleInterval requests per thread rather than on every one.
+  const Size heapSampleInterval = 64;
 
-    ext::shared_ptr<StrikedTypePayoff> payoff(
-      new PlainVanillaPayoff(
-        oP.type,
-        oP.strike));
+  void sampleHeap(){
+    raiseTo(peakHeapInUse(), currentHeap().inUse);
+  };
 
-    ext::shared_ptr<BlackScholesMertonProcess> bsmProcess(
-      new BlackScholesMertonProcess(
-        underlyingH,
-        flatDividendTS,
-        flatTermStructure,
-        flatVolTS));
+  allocationTotals &arenaTotals(){
+    static allocationTotals totals;
+    return totals;
+  };
 
-    VanillaOption europeanOption(payoff, europeanExercise);
+  struct arenaState {
+    requestArena *arena = nullptr;
+    requestArena *active = nullptr;
+    Size depth = 0;
+    Size scopes = 0;
 
-    europeanOption.setPricingEngine(
-      ext::shared_ptr<PricingEngine>(
-        new AnalyticEuropeanEngine(bsmProcess)));
+    ~arenaState() {
+      if (arena)
+        arena->release();
+    }
+  };
 
-    oP.request["NPV"]["Black-Scholes"] = europeanOption.NPV();
-    oP.request["gamma"]["Black-Scholes"] = europeanOption.gamma();
-    oP.request["delta"]["Black-Scholes"] = europeanOption.delta();
-    oP.request["rho"]["Black-Scholes"] = europeanOption.rho();
-    oP.request["vega"]["Black-Scholes"] = europeanOption.vega();
-    oP.request["theta"]["Black-Scholes"] = europeanOption.theta();
-    oP.request["thetaPerDay"]["Black-Scholes"] = europeanOption.thetaPerDay();
+  arenaState &threadArena(){
+    thread_local arenaState state;
+    return state;
+  };
 
-    return oP.request.dump();
+  // Routes arena-aware allocations on this thread to its arena until the
+  // scope ends. Scopes nest; only the outermost one rewinds.
+  class arenaScope {
+    public:
+      arenaScope() {
+        arenaState &state = threadArena();
+        if (state.depth++ == 0) {
+          if (!state.arena)
+            state.arena = new requestArena;
+          state.active = state.arena;
+        }
+      }
+
+      ~arenaScope() {
+        arenaState &state = threadArena();
+        if (--state.depth == 0) {
+          state.active = nullptr;
+          const std::pair<Size, Size> counts = state.arena->takeCounts();
+          allocationTotals &totals = arenaTotals();
+          totals.scopes.fetch_add(1, std::memory_order_relaxed);
+          totals.blocks.fetch_add(counts.first, std::memory_order_relaxed);
+          totals.bytes.fetch_add(counts.second, std::memory_order_relaxed);
+          totals.lastBytes.store(counts.second, std::memory_order_relaxed);
+          raiseTo(totals.largestBytes, counts.second);
+          if (++state.scopes % heapSampleInterval == 0)
+            sampleHeap();
+          if (state.arena->idle()) {
+            state.arena->rewind();
+          } else {
+            state.arena->release();
+            state.arena = nullptr;
+          }
+        }
+      }
+
+      arenaScope(const arenaScope&) = delete;
+      arenaScope &operator=(const arenaScope&) = delete;
   };
 
-  std::string calcuateAmericanOption(optionParameters &oP){
+  // Sends allocations back to the heap for values that outlive the
+  // request, such as cache entries and results shared with other threads.
+  class arenaSuspend {
+    public:
+      arenaSuspend() : saved(threadArena().active) { threadArena().active = nullptr; }
+      ~arenaSuspend() { threadArena().active = saved; }
 
-    Calendar calendar = TARGET();
-    DayCounter dayCounter = Actual365Fixed();
-    Settings::instance().evaluationDate() = oP.todaysDate;
-    Volatility impliedVolatility(oP.optionPrice);
+      arenaSuspend(const arenaSuspend&) = delete;
+      arenaSuspend &operator=(const arenaSuspend&) = delete;
 
-    oP.request["ImpliedVolatility"] = impliedVolatility;
+    private:
+      requestArena *saved;
+  };
 
-    std::vector<Date> exerciseDates;
-    for (Integer i = 1; i <= 4; i++)
-      exerciseDates.push_back(oP.settlementDate + 3 * i * Months);
+  // Every block starts with a header naming its arena (null for the heap),
+  // so blocks can be freed from any thread and after their scope has ended.
+  struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) arenaHeader {
+    requestArena *arena;
+  };
 
-    ext::shared_ptr<Exercise> americanExercise(
-      new AmericanExercise(
-        oP.settlementDate,
-        oP.maturityDate));
+  template <class T>
+  struct arenaAllocator {
+    typedef T value_type;
+
+    arenaAllocator() noexcept {}
+    template <class U> arenaAllocator(const arenaAllocator<U>&) noexcept {}
+
+    T *allocate(std::size_t n) {
+      static_assert(alignof(T) <= alignof(arenaHeader), "over-aligned type in arena");
+      if (n > (std::size_t(-1) - sizeof(arenaHeader)) / sizeof(T))
+        throw std::bad_alloc();
+      const Size bytes = (sizeof(arenaHeader) + n * sizeof(T) + alignof(arenaHeader) - 1)
+                         & ~(alignof(arenaHeader) - 1);
+      requestArena *arena = threadArena().active;
+      arenaHeader *header = static_cast<arenaHeader*>(arena ? arena->allocate(bytes) : ::operator new(bytes));
+      header->arena = arena;
+      if (arena)
+        arena->retain();
+      return reinterpret_cast<T*>(header + 1);
+    }
 
-    Handle<Quote> underlyingH(
-      ext::shared_ptr<Quote>(
-        new SimpleQuote(oP.underlying)));
+    void deallocate(T *p, std::size_t) noexcept {
+      arenaHeader *header = reinterpret_cast<arenaHeader*>(p) - 1;
+      if (header->arena)
+        header->arena->release();
+      else
+        ::operator delete(header);
+    }
+  };
 
-    Handle<YieldTermStructure> flatTermStructure(
-      ext::shared_ptr<YieldTermStructure>(
-        new FlatForward(
-          oP.settlementDate,
-          oP.riskFreeRate,
-          dayCounter)));
+  template <class T, class U>
+  bool operator==(const arenaAllocator<T>&, const arenaAllocator<U>&) { return true; }
 
-    Handle<YieldTermStructure> flatDividendTS(
-      ext::shared_ptr<YieldTermStructure>(
-        new FlatForward(
-          oP.settlementDate,
-          oP.dividendYield,
-          dayCounter)));
+  template <class T, class U>
+  bool operator!=(const arenaAllocator<T>&, const arenaAllocator<U>&) { return false; }
 
-    Handle<BlackVolTermStructure> flatVolTS(
-      ext::shared_ptr<BlackVolTermStructure>(
-        new BlackConstantVol(
-          oP.settlementDate,
-          calendar,
-          impliedVolatility,
-          dayCounter)));
+  // Live counts of the QuantLib objects created through makeShared, by
+  // kind, to spot observers and term structures that are never released.
+  enum objectKind {
+    quoteObjects, termStructureObjects, processObjects, engineObjects,
+    instrumentObjects, otherObjects, objectKindCount
+  };
 
-    ext::shared_ptr<StrikedTypePayoff> payoff(
-      new PlainVanillaPayoff(oP.type, oP.strike));
+  const char *const objectKindNames[objectKindCount] = {
+    "quotes", "termStructures", "processes", "engines", "instruments", "other"
+  };
 
-    ext::shared_ptr<BlackScholesMertonProcess> bsmProcess(
-      new BlackScholesMertonProcess(
-        underlyingH,
-        flatDividendTS,
-        flatTermStructure,
-        flatVolTS));
+  std::atomic<std::int64_t> *liveObjects(){
+    static std::atomic<std::int64_t> counts[objectKindCount] = {};
+    return counts;
+  };
 
-    VanillaOption americanOption(payoff, americanExercise);
+  template <class T>
+  struct objectKindOf : std::integral_constant<int,
+    std::is_base_of<Quote, T>::value ? quoteObjects :
+    std::is_base_of<TermStructure, T>::value ? termStructureObjects :
+    std::is_base_of<StochasticProcess, T>::value ? processObjects :
+    std::is_base_of<PricingEngine, T>::value ? engineObjects :
+    std::is_base_of<Instrument, T>::value ? instrumentObjects : otherObjects> {};
+
+  // The arena allocator, counting its blocks under Kind. allocate_shared
+  // takes one block per object (with its control block), so the count is
+  // the number of live objects. Rebinding keeps the kind.
+  template <class T, class Kind>
+  struct trackedAllocator : arenaAllocator<T> {
+    typedef T value_type;
+
+    trackedAllocator() noexcept {}
+    template <class U> trackedAllocator(const trackedAllocator<U, Kind>&) noexcept {}
+
+    T *allocate(std::size_t n) {
+      T *p = arenaAllocator<T>::allocate(n);
+      liveObjects()[Kind::value].fetch_add(1, std::memory_order_relaxed);
+      return p;
+    }
 
-    ext::shared_ptr<PricingEngine> fdengine =
-      ext::make_shared<FdBlackScholesVanillaEngine>(
-        bsmProcess,
-        oP.timeSteps,
-        oP.timeSteps - 1);
+    void deallocate(T *p, std::size_t n) noexcept {
+      liveObjects()[Kind::value].fetch_sub(1, std::memory_order_relaxed);
+      arenaAllocator<T>::deallocate(p, n);
+    }
+  };
 
-    americanOption.setPricingEngine(fdengine);
-    oP.request["NPV"]["Finite-Differences"] = americanOption.NPV();
-    oP.request["gamma"]["Finite-Differences"] = americanOption.gamma();
-    oP.request["delta"]["Finite-Differences"] = americanOption.delta();
-    oP.request["theta"]["Finite-Differences"] = americanOption.theta();
+  template <class T, class U, class Kind>
+  bool operator==(const trackedAllocator<T, Kind>&, const trackedAllocator<U, Kind>&) { return true; }
 
-    americanOption.setPricingEngine(
-      ext::shared_ptr<PricingEngine>(
-        new BinomialVanillaEngine<JarrowRudd>(
-          bsmProcess,
-          oP.timeSteps)));
+  template <class T, class U, class Kind>
+  bool operator!=(const trackedAllocator<T, Kind>&, const trackedAllocator<U, Kind>&) { return false; }
 
-    oP.request["NPV"]["Binomial-Jarrow-Rudd"] = americanOption.NPV();
-    oP.request["gamma"]["Binomial-Jarrow-Rudd"] = americanOption.gamma();
-    oP.request["delta"]["Binomial-Jarrow-Rudd"] = americanOption.delta();
-    oP.request["theta"]["Binomial-Jarrow-Rudd"] = americanOption.theta();
+  // ext::make_shared through the arena allocator.
+  template <class T, class... Args>
+  ext::shared_ptr<T> makeShared(Args&&... args){
+    typedef trackedAllocator<T, objectKindOf<T> > allocator;
+#if defined(QL_USE_STD_SHARED_PTR)
+    return std::allocate_shared<T>(allocator(), std::forward<Args>(args)...);
+#else
+    return boost::allocate_shared<T>(allocator(), std::forward<Args>(args)...);
+#endif
+  };
+}
 
-    americanOption.setPricingEngine(
-      ext::shared_ptr<PricingEngine>(
-        new BinomialVanillaEngine<CoxRossRubinstein>(
-          bsmProcess,
-          oP.timeSteps)));
+using namespace optionsMemory;
 
-    oP.request["NPV"]["Binomial-Cox-Ross-Rubinstein"] = americanOption.NPV();
-    oP.request["gamma"]["Binomial-Cox-Ross-Rubinstein"] = americanOption.gamma();
-    oP.request["delta"]["Binomial-Cox-Ross-Rubinstein"] = americanOption.delta();
-    oP.request["theta"]["Binomial-Cox-Ross-Rubinstein"] = americanOption.theta();
+// JSON values use the arena allocator too: nodes built while a request is
+// in an arenaScope live in its arena, anything else on the heap.
+using json = nlohmann::basic_json<std::map, std::vector, std::string, bool,
+                                  std::int64_t, std::uint64_t, double, arenaAllocator>;
 
-    americanOption.setPricingEngine(
-      ext::shared_ptr<PricingEngine>(
-        new BinomialVanillaEngine<AdditiveEQPBinomialTree>(
-          bsmProcess,
-          oP.timeSteps)));
+namespace
+{
+  // Nanoseconds on a monotonic clock: steady_clock natively,
+  // performance.now() in the browser.
+  std::int64_t profileClock(){
+#ifdef __EMSCRIPTEN__
+    return std::int64_t(emscripten_get_now() * 1e6);
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  };
 
-    oP.request["NPV"]["Additive-equiprobabilities"] = americanOption.NPV();
-    oP.request["gamma"]["Additive-equiprobabilities"] = americanOption.gamma();
-    oP.request["delta"]["Additive-equiprobabilities"] = americanOption.delta();
-    oP.request["theta"]["Additive-equiprobabilities"] = americanOption.theta();
+  // Timings collected for a request that sets "profile": true. Phases and
+  // engines are recorded in the order they ran.
+  struct requestProfile {
+    std::int64_t start;
+    std::vector<std::pair<const char*, std::int64_t> > phases;
+    std::vector<std::pair<const char*, std::int64_t> > engines;
 
-    americanOption.setPricingEngine(
-      ext::shared_ptr<PricingEngine>(
-        new BinomialVanillaEngine<Trigeorgis>(
-          bsmProcess,
-          oP.timeSteps)));
+    explicit requestProfile(std::int64_t start) : start(start) {}
+  };
 
-    oP.request["NPV"]["Binomial-Trigeorgis"] = americanOption.NPV();
-    oP.request["gamma"] ["Binomial-Trigeorgis"]= americanOption.gamma();
-    oP.request["delta"]["Binomial-Trigeorgis"] = americanOption.delta();
-    oP.request["theta"]["Binomial-Trigeorgis"] = americanOption.theta();
+  // Records the time until stop() or the end of the scope. A null profile
+  // makes it a no-op, which is the path every unprofiled request takes.
+  class profileTimer {
+    public:
+      profileTimer(requestProfile *profile, const char *name)
+      : profile(profile), name(name), start(profile ? profileClock() : 0) {}
+
+      ~profileTimer() { stop(); }
+
+      void stop() {
+        if (!profile)
+          return;
+        profile->phases.push_back(std::make_pair(name, profileClock() - start));
+        profile = nullptr;
+      }
+
+      profileTimer(const profileTimer&) = delete;
+      profileTimer &operator=(const profileTimer&) = delete;
+
+    private:
+      requestProfile *profile;
+      const char *name;
+      std::int64_t start;
+  };
 
-    americanOption.setPricingEngine(
-      ext::shared_ptr<PricingEngine>(
-        new BinomialVanillaEngine<Tian>(
-          bsmProcess,
-          oP.timeSteps)));
+  // Log-linear latency histogram after HdrHistogram: eight linear
+  // sub-buckets per power of two, so a quantile is reported to within
+  // 12.5% of the recorded value. Recording is three relaxed atomic adds.
+  class latencyHistogram {
+    public:
+      static const Size subBuckets = 8;
+      static const Size bucketCount = 62 * subBuckets;
+
+      void record(std::int64_t nanoseconds) {
+        const std::uint64_t value = nanoseconds > 0 ? std::uint64_t(nanoseconds) : 0;
+        buckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+      }
+
+      // Upper bound of the bucket holding the q-th quantile.
+      std::uint64_t quantile(double q) const {
+        const std::uint64_t total = count.load(std::memory_order_relaxed);
+        if (total == 0)
+          return 0;
+        const std::uint64_t rank = std::max<std::uint64_t>(1, std::uint64_t(std::ceil(q * double(total))));
+        std::uint64_t seen = 0;
+        for (Size i = 0; i < bucketCount; i++) {
+          seen += buckets[i].load(std::memory_order_relaxed);
+          if (seen >= rank)
+            return upperBound(i);
+        }
+        return upperBound(bucketCount - 1);
+      }
+
+      std::uint64_t samples() const { return count.load(std::memory_order_relaxed); }
+      std::uint64_t total() const { return sum.load(std::memory_order_relaxed); }
+
+    private:
+      static Size bucket(std::uint64_t value) {
+        if (value < subBuckets)
+          return Size(value);
+        const int exponent = 63 - __builtin_clzll(value);
+        const int shift = exponent - 3;
+        return Size(shift + 1) * subBuckets + Size((value >> shift) & (subBuckets - 1));
+      }
+
+      static std::uint64_t upperBound(Size index) {
+        if (index < subBuckets)
+          return index;
+        const int shift = int(index / subBuckets) - 1;
+        const std::uint64_t mantissa = (index % subBuckets) | subBuckets;
+        return ((mantissa + 1) << shift) - 1;
+      }
+
+      std::atomic<std::uint64_t> buckets[bucketCount] = {};
+      std::atomic<std::uint64_t> count{0};
+      std::atomic<std::uint64_t> sum{0};
+  };
 
-    oP.request["NPV"] ["Binomial-Tian"]= americanOption.NPV();
-    oP.request["gamma"]["Binomial-Tian"] = americanOption.gamma();
-    oP.request["delta"]["Binomial-Tian"] = americanOption.delta();
-    oP.request["theta"]["Binomial-Tian"] = americanOption.theta();
+  // Engines as named by makeEngine, plus a slot for anything else.
+  const char *const engineNames[] = {
+    "Black-Scholes", "Finite-Differences", "Binomial-Jarrow-Rudd",
+    "Binomial-Cox-Ross-Rubinstein", "Additive-equiprobabilities", "Binomial-Trigeorgis",
+    "Binomial-Tian", "Binomial-Leisen-Reimer", "Binomial-Joshi", "Barone-Adesi-Whaley", "other"
+  };
+  const Size engineCount = sizeof(engineNames) / sizeof(engineNames[0]);
 
-    americanOption.setPricingEngine(
-      ext::shared_ptr<PricingEngine>(
-        new BinomialVanillaEngine<LeisenReimer>(
-          bsmProcess,
-          oP.timeSteps)));
+  Size engineIndex(const char *engine){
+    for (Size i = 0; i + 1 < engineCount; i++)
+      if (std::strcmp(engine, engineNames[i]) == 0)
+        return i;
+    return engineCount - 1;
+  };
 
-    oP.request["NPV"]["Binomial-Leisen-Reimer"] = americanOption.NPV();
-    oP.request["gamma"]["Binomial-Leisen-Reimer"] = americanOption.gamma();
-    oP.request["delta"]["Binomial-Leisen-Reimer"] = americanOption.delta();
-    oP.request["theta"]["Binomial-Leisen-Reimer"] = americanOption.theta();
+  // Execution styles, plus a slot for requests that failed before their
+  // style was known.
+  const char *const styleNames[] = { "european", "american", "bermudan", "unknown" };
+  const Size styleCount = sizeof(styleNames) / sizeof(styleNames[0]);
 
-    americanOption.setPricingEngine(
-      ext::shared_ptr<PricingEngine>(
-        new BinomialVanillaEngine<Joshi4>(
-            bsmProcess, oP.timeSteps)));
+  Size styleIndex(int executionStyle){
+    return executionStyle >= 0 && executionStyle < int(styleCount) - 1 ? Size(executionStyle) : styleCount - 1;
+  };
 
-    oP.request["NPV"]["Binomial-Joshi"] = americanOption.NPV();
-    oP.request["delta"]["Binomial-Joshi"] = americanOption.delta();
-    oP.request["gamma"]["Binomial-Joshi"] = americanOption.gamma();
-    oP.request["theta"]["Binomial-Joshi"] = americanOption.theta();
+  // Process-wide pricing metrics. Everything is a relaxed atomic, so
+  // recording never takes a lock; getMetrics() reads a snapshot that is
+  // consistent per value rather than across values.
+  struct pricingMetrics {
+    struct engineStats {
+      std::atomic<std::uint64_t> calls{0};
+      std::atomic<std::uint64_t> errors{0};
+      latencyHistogram latency;
+    };
+
+    std::atomic<std::uint64_t> requests[styleCount] = {};
+    std::atomic<std::uint64_t> errors[styleCount] = {};
+    latencyHistogram requestLatency[styleCount];
+    engineStats engines[engineCount];
+  };
 
-    return oP.request.dump();
+  pricingMetrics &metrics(){
+    static pricingMetrics registry;
+    return registry;
   };
 
-  std::string calcuateBermudanOption(optionParameters &oP){
-    
-    Calendar calendar = TARGET();
-    DayCounter dayCounter = Actual365Fixed();
-    Settings::instance().evaluationDate() = oP.todaysDate;
-    Volatility impliedVolatility(oP.optionPrice);
+  // Times one entry point call. Unwinding out of it counts as an error.
+  class requestMetrics {
+    public:
+      requestMetrics() : start(profileClock()), exceptions(std::uncaught_exceptions()) {}
+
+      ~requestMetrics() {
+        pricingMetrics &registry = metrics();
+        if (std::uncaught_exceptions() > exceptions || failed) {
+          registry.errors[style].fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+        registry.requests[style].fetch_add(1, std::memory_order_relaxed);
+        registry.requestLatency[style].record(profileClock() - start);
+      }
+
+      void executionStyle(int executionStyle) { style = styleIndex(executionStyle); }
+      void fail() { failed = true; }
+
+      const std::int64_t start;
+
+      requestMetrics(const requestMetrics&) = delete;
+      requestMetrics &operator=(const requestMetrics&) = delete;
+
+    private:
+      Size style = styleCount - 1;
+      int exceptions;
+      bool failed = false;
+  };
 
-    oP.request["ImpliedVolatility"] = impliedVolatility;
+  // Times one engine for the metrics and, when profiling, for the request's
+  // timings under the label it is reported with.
+  class engineTimer {
+    public:
+      engineTimer(requestProfile *profile, const char *label, const char *engine)
+      : profile(profile), label(label), stats(metrics().engines[engineIndex(engine)]),
+        start(profileClock()), exceptions(std::uncaught_exceptions()) {}
+
+      ~engineTimer() {
+        if (discarded)
+          return;
+        const std::int64_t elapsed = profileClock() - start;
+        stats.calls.fetch_add(1, std::memory_order_relaxed);
+        if (std::uncaught_exceptions() > exceptions)
+          stats.errors.fetch_add(1, std::memory_order_relaxed);
+        else
+          stats.latency.record(elapsed);
+        if (profile)
+          profile->engines.push_back(std::make_pair(label, elapsed));
+      }
+
+      // Records nothing, for a call handed on to another timed path.
+      void discard() { discarded = true; }
+
+      engineTimer(const engineTimer&) = delete;
+      engineTimer &operator=(const engineTimer&) = delete;
+
+    private:
+      requestProfile *profile;
+      const char *label;
+      pricingMetrics::engineStats &stats;
+      std::int64_t start;
+      int exceptions;
+      bool discarded = false;
+  };
+
+  // Takes a request's numeric results in place of its JSON response, for
+  // callers that store them elsewhere. engine is null for the results that
+  // are not per engine, such as ImpliedVolatility.
+  struct resultSink {
+    virtual void record(const char *field, const char *engine, double value) = 0;
+    virtual ~resultSink() {}
+  };
 
+  struct optionParameters {
+    int executionStyle;
+    Date todaysDate;
+    QuantLib::Option::Type type;
+    double strike;
+    Date settlementDate;
+    Date maturityDate;
+    double underlying;
+    double optionPrice;
+    double dividendYield;
+    double riskFreeRate;
+    double timeSteps;
+    unsigned integerFields = 0;
+    std::uint32_t responseFields = ~std::uint32_t(0);
+    bool compactLayout = false;
+    bool profileRequested = false;
+    double deadlineMicros = 0.0;
+    std::int64_t received = 0;
+    std::string requestId;
     std::vector<Date> exerciseDates;
-    for (Integer i = 1; i <= 4; i++)
-      exerciseDates.push_back(oP.settlementDate + 3 * i * Months);
+    Frequency exerciseFrequency = NoFrequency;
+    Size exerciseCalendar = 0;
+    BusinessDayConvention exerciseConvention = Following;
+    std::vector<std::pair<Date, double> > dividends;
+    ext::shared_ptr<YieldTermStructure> riskFreeCurve;
+    std::string riskFreeCurveName;
+    std::uint64_t riskFreeCurveGeneration = 0;
+    requestProfile *profile = nullptr;
+    const std::function<void(const json&)> *progress = nullptr;
+    resultSink *sink = nullptr;
+    json request;
+  };
 
-    ext::shared_ptr<Exercise> bermudanExercise(
-      new BermudanExercise(exerciseDates));
+  void recordResult(optionParameters &oP, const char *field, const char *engine, double value){
+    if (oP.sink)
+      oP.sink->record(field, engine, value);
+    else if (engine)
+      oP.request[field][engine] = value;
+    else
+      oP.request[field] = value;
+  };
 
-    Handle<Quote> underlyingH(
-      ext::shared_ptr<Quote>(
-        new SimpleQuote(oP.underlying)));
+  struct optionGreeks {
+    double NPV = 0.0;
+    double delta = 0.0;
+    double gamma = 0.0;
+    double vega = 0.0;
+    double theta = 0.0;
+    double rho = 0.0;
+  };
 
-    Handle<YieldTermStructure> flatTermStructure(
-    ext::shared_ptr<YieldTermStructure>(
-      new FlatForward(
-        oP.settlementDate,
-        oP.riskFreeRate,
-        dayCounter)));
+  struct requestCancelled : std::runtime_error {
+    requestCancelled() : std::runtime_error("request cancelled") {}
+  };
+
+  // Tokens of the in-flight requests that sent a requestId. Ids need not be
+  // unique; cancelling one cancels every request in flight under it.
+  struct cancellationRegistry {
+    std::mutex mutex;
+    std::unordered_multimap<std::string, std::shared_ptr<std::atomic<bool> > > tokens;
+  };
+
+  cancellationRegistry &cancellations(){
+    static cancellationRegistry registry;
+    return registry;
+  };
+
+  const std::atomic<bool> *&currentCancellation(){
+    thread_local const std::atomic<bool> *token = nullptr;
+    return token;
+  };
+
+#ifdef OPTIONS_ASYNCIFY
+  // While calcuateOptionAsync runs, checkpoints hand the event loop back to
+  // the browser once yieldIntervalMs of work has gone by. Calls made from
+  // JavaScript while it is suspended run straight through.
+  struct asyncYielding {
+    bool active = false;
+    bool suspended = false;
+    double lastYield = 0.0;
+  };
+
+  const double yieldIntervalMs = 8.0;
+
+  asyncYielding &yielding(){
+    static asyncYielding state;
+    return state;
+  };
+#endif
+
+  // Entry points that price call this first. A synchronous call made from
+  // JavaScript while calcuateOptionAsync is suspended would run inside that
+  // call's pricing context, arena and cancellation scope, so it is refused.
+  void refuseWhileSuspended(){
+#ifdef OPTIONS_ASYNCIFY
+    QL_REQUIRE(!yielding().suspended,
+               "a calcuateOptionAsync call is suspended; wait for its Promise before pricing again");
+#endif
+  };
+
+  // A point where pricing may stop: called between engines, on every time
+  // step by the FD solver, and by the trees on every step where early
+  // exercise applies. Throws requestCancelled if
+  // the request running on this thread has been cancelled; under
+  // calcuateOptionAsync it may also yield to the browser first.
+  void pricingCheckpoint(){
+#ifdef OPTIONS_ASYNCIFY
+    asyncYielding &state = yielding();
+    if (state.active && !state.suspended && emscripten_get_now() - state.lastYield > yieldIntervalMs) {
+      state.suspended = true;
+      emscripten_sleep(0);
+      state.suspended = false;
+      state.lastYield = emscripten_get_now();
+    }
+#endif
+    const std::atomic<bool> *token = currentCancellation();
+    if (token && token->load(std::memory_order_relaxed))
+      throw requestCancelled();
+  };
+
+  // Registers the request under its id, if it has one, and makes its token
+  // the one pricingCheckpoint checks on this thread.
+  class cancellationScope {
+    public:
+      explicit cancellationScope(const std::string &requestId)
+      : previous(currentCancellation()), requestId(requestId) {
+        if (requestId.empty())
+          return;
+        token = std::make_shared<std::atomic<bool> >(false);
+        cancellationRegistry &registry = cancellations();
+        {
+          std::lock_guard<std::mutex> lock(registry.mutex);
+          registry.tokens.insert(std::make_pair(requestId, token));
+        }
+        currentCancellation() = token.get();
+      }
+
+      ~cancellationScope() {
+        if (!token)
+          return;
+        currentCancellation() = previous;
+        // Found again by id and token: inserts by other requests may have
+        // rehashed the map since, invalidating any stored iterator.
+        cancellationRegistry &registry = cancellations();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        auto found = registry.tokens.equal_range(requestId);
+        for (auto it = found.first; it != found.second; ++it)
+          if (it->second == token) {
+            registry.tokens.erase(it);
+            break;
+          }
+      }
+
+      cancellationScope(const cancellationScope&) = delete;
+      cancellationScope &operator=(const cancellationScope&) = delete;
+
+    private:
+      const std::atomic<bool> *previous;
+      const std::string requestId;
+      std::shared_ptr<std::atomic<bool> > token;
+  };
+
+  // Forwards to another curve, checking for cancellation on the way. The FD
+  // solver asks the risk-free curve for a forward rate on every time step.
+  class cancellableCurve : public YieldTermStructure {
+    public:
+      explicit cancellableCurve(const Handle<YieldTermStructure> &curve)
+      : YieldTermStructure(curve->dayCounter()), curve(curve) {
+        registerWith(curve);
+      }
+
+      const Date &referenceDate() const override { return curve->referenceDate(); }
+      Calendar calendar() const override { return curve->calendar(); }
+      Date maxDate() const override { return curve->maxDate(); }
+
+    protected:
+      DiscountFactor discountImpl(Time t) const override {
+        pricingCheckpoint();
+        return curve->discount(t, true);
+      }
+
+    private:
+      Handle<YieldTermStructure> curve;
+  };
+
+  // A binomial tree that checks for cancellation during the rollback.
+  // BlackScholesLattice reads the branch probabilities once, up front, and
+  // steps back without calling the tree; what it does ask for is the
+  // underlying on every node of a step where early exercise applies. That
+  // is every step of an American rollback and each exercise date of a
+  // Bermudan one, and the first node of such a step is the checkpoint.
+  template <class T>
+  class cancellableTree : public T {
+    public:
+      using T::T;
+
+      Real underlying(Size i, Size index) const {
+        if (index == 0)
+          pricingCheckpoint();
+        return T::underlying(i, index);
+      }
+  };
+
+  // A risk-free curve loaded by loadYieldCurve: discount factors at pillar
+  // dates, interpolated log-linearly (flat forwards between pillars) and
+  // extrapolated on the last forward. One curve serves every request that
+  // names it on its valuation date, read-only and from many threads, so
+  // requests reach it through handles that do not register as observers.
+  class pillarCurve : public YieldTermStructure {
+    public:
+      pillarCurve(const Date &referenceDate,
+                  const std::vector<Date> &dates,
+                  const std::vector<DiscountFactor> &factors)
+      : YieldTermStructure(referenceDate, NullCalendar(), Actual365Fixed()),
+        times(1, 0.0), logFactors(1, 0.0) {
+        for (Size i = 0; i < dates.size(); i++) {
+          times.push_back(Real(dates[i] - referenceDate) / 365.0);
+          logFactors.push_back(std::log(factors[i]));
+        }
+        const Size days = std::min<Size>(dates.back() - referenceDate, maxTableDays) + 1;
+        std::vector<Time> dayTimes(days);
+        for (Size day = 0; day < days; day++)
+          dayTimes[day] = Real(day) / 365.0;
+        byDay.resize(days);
+        discounts(dayTimes.data(), byDay.data(), days);
+      }
+
+      Date maxDate() const override { return Date::maxDate(); }
+
+      // Discount factors for a batch of times: one pass with no virtual
+      // calls, and no search while the times ascend. It fills the day table
+      // at load time and a scenario grid's slice and maturity tables; the
+      // engines still ask for one time at a time through the
+      // ImpliedTermStructure and discountImpl.
+      void discounts(const Time *t, DiscountFactor *factors, Size count) const {
+        Size segment = 1;
+        for (Size k = 0; k < count; k++) {
+          if (k > 0 && t[k] < t[k - 1])
+            segment = 1;
+          while (segment + 1 < times.size() && times[segment] < t[k])
+            segment++;
+          factors[k] = std::exp(logFactors[segment - 1]
+                                + (logFactors[segment] - logFactors[segment - 1])
+                                  * (t[k] - times[segment - 1]) / (times[segment] - times[segment - 1]));
+        }
+      }
+
+      // The discount factor to a date, from a table of whole days up to the
+      // last pillar.
+      DiscountFactor discountOn(const Date &date) const {
+        const Date::serial_type day = date - referenceDate();
+        if (day >= 0 && Size(day) < byDay.size())
+          return byDay[day];
+        return discountImpl(Real(day) / 365.0);
+      }
+
+    protected:
+      DiscountFactor discountImpl(Time t) const override {
+        DiscountFactor factor;
+        discounts(&t, &factor, 1);
+        return factor;
+      }
+
+    private:
+      static constexpr Size maxTableDays = 50 * 366;
+
+      std::vector<Time> times;
+      std::vector<Real> logFactors;
+      std::vector<DiscountFactor> byDay;
+  };
+
+  // Curves from loadYieldCurve by name and valuation date. Loading again
+  // replaces a curve for later requests while those holding the old one
+  // finish on it; generation keeps their cached results apart. Loading for
+  // a later valuation date drops the curves of earlier ones, as resultCache
+  // does with results.
+  struct yieldCurveRegistry {
+    struct entry {
+      ext::shared_ptr<pillarCurve> curve;
+      std::uint64_t generation;
+    };
+
+    std::mutex mutex;
+    std::map<std::pair<std::string, Date::serial_type>, entry> curves;
+    std::uint64_t generations = 0;
+    Date newestDate;
+
+    // Called with the mutex held.
+    void expire(const Date &todaysDate) {
+      if (newestDate != Date() && todaysDate <= newestDate)
+        return;
+      newestDate = todaysDate;
+      for (auto it = curves.begin(); it != curves.end();) {
+        if (it->first.second < newestDate.serialNumber())
+          it = curves.erase(it);
+        else
+          ++it;
+      }
+    }
+  };
+
+  yieldCurveRegistry &yieldCurves(){
+    static yieldCurveRegistry registry;
+    return registry;
+  };
+
+  // Flat market objects behind SimpleQuotes so that legs sharing a process
+  // can be bumped together for numerical vega and rho. Given a loaded
+  // riskFreeCurve, the risk-free side is that curve seen from referenceDate
+  // instead, and bumping market.riskFreeRate moves nothing.
+  struct marketObjects {
+    ext::shared_ptr<SimpleQuote> underlying;
+    ext::shared_ptr<SimpleQuote> volatility;
+    ext::shared_ptr<SimpleQuote> riskFreeRate;
+    ext::shared_ptr<SimpleQuote> dividendYield;
+    ext::shared_ptr<BlackScholesMertonProcess> bsmProcess;
+  };
+
+  marketObjects makeMarketObjects(const Date &referenceDate,
+                                  double underlying,
+                                  double volatility,
+                                  double riskFreeRate,
+                                  double dividendYield,
+                                  const ext::shared_ptr<YieldTermStructure> &riskFreeCurve
+                                    = ext::shared_ptr<YieldTermStructure>()){
+
+    Calendar calendar = TARGET();
+    DayCounter dayCounter = Actual365Fixed();
+
+    marketObjects market;
+    market.underlying = makeShared<SimpleQuote>(underlying);
+    market.volatility = makeShared<SimpleQuote>(volatility);
+    market.riskFreeRate = makeShared<SimpleQuote>(riskFreeRate);
+    market.dividendYield = makeShared<SimpleQuote>(dividendYield);
+
+    Handle<YieldTermStructure> riskFreeTS(
+      riskFreeCurve
+        ? ext::shared_ptr<YieldTermStructure>(
+            makeShared<ImpliedTermStructure>(
+              Handle<YieldTermStructure>(riskFreeCurve, false),
+              referenceDate))
+        : ext::shared_ptr<YieldTermStructure>(
+            makeShared<FlatForward>(
+              referenceDate,
+              Handle<Quote>(market.riskFreeRate),
+              dayCounter)));
 
     Handle<YieldTermStructure> flatDividendTS(
       ext::shared_ptr<YieldTermStructure>(
-        new FlatForward(
-          oP.settlementDate,
-          oP.dividendYield,
+        makeShared<FlatForward>(
+          referenceDate,
+          Handle<Quote>(market.dividendYield),
           dayCounter)));
 
     Handle<BlackVolTermStructure> flatVolTS(
       ext::shared_ptr<BlackVolTermStructure>(
-        new BlackConstantVol(
-          oP.settlementDate,
+        makeShared<BlackConstantVol>(
+          referenceDate,
           calendar,
-          impliedVolatility,
+          Handle<Quote>(market.volatility),
           dayCounter)));
 
-    ext::shared_ptr<StrikedTypePayoff> payoff(
-      new PlainVanillaPayoff(
-        oP.type,
-        oP.strike));
+    market.bsmProcess = makeShared<BlackScholesMertonProcess>(
+      Handle<Quote>(market.underlying),
+      flatDividendTS,
+      Handle<YieldTermStructure>(
+        ext::shared_ptr<YieldTermStructure>(
+          makeShared<cancellableCurve>(riskFreeTS))),
+      flatVolTS);
 
-    ext::shared_ptr<BlackScholesMertonProcess> bsmProcess(
-      new BlackScholesMertonProcess(
-        underlyingH,
-        flatDividendTS,
-        flatTermStructure,
-        flatVolTS));
+    return market;
+  };
 
-    VanillaOption bermudanOption(payoff, bermudanExercise);
+  // Another volatility on the same spot quote and curves.
+  marketObjects withVolatility(const marketObjects &base, double volatility){
 
-    ext::shared_ptr<PricingEngine> fdengine =
-      ext::make_shared<FdBlackScholesVanillaEngine>(
-        bsmProcess,
-        oP.timeSteps,
-        oP.timeSteps - 1);
-    bermudanOption.setPricingEngine(fdengine);
+    marketObjects market = base;
+    market.volatility = makeShared<SimpleQuote>(volatility);
 
-    oP.request["NPV"]["Finite-differences"] = bermudanOption.NPV();
-    oP.request["gamma"]["Finite-differences"] = bermudanOption.gamma();
-    oP.request["delta"]["Finite-differences"] = bermudanOption.delta();
-    oP.request["theta"]["Finite-differences"] = bermudanOption.theta();
+    Handle<BlackVolTermStructure> flatVolTS(
+      ext::shared_ptr<BlackVolTermStructure>(
+        makeShared<BlackConstantVol>(
+          base.bsmProcess->blackVolatility()->referenceDate(),
+          base.bsmProcess->blackVolatility()->calendar(),
+          Handle<Quote>(market.volatility),
+          base.bsmProcess->blackVolatility()->dayCounter())));
+
+    market.bsmProcess = makeShared<BlackScholesMertonProcess>(
+      base.bsmProcess->stateVariable(),
+      base.bsmProcess->dividendYield(),
+      base.bsmProcess->riskFreeRate(),
+      flatVolTS);
+
+    return market;
+  };
 
-    bermudanOption.setPricingEngine(
-      ext::shared_ptr<PricingEngine>(
-        new BinomialVanillaEngine<JarrowRudd>(
-          bsmProcess,
-          oP.timeSteps)));
+  // The same market for the trees, which know nothing of cash dividends:
+  // the escrowed model, with the spot net of the present value of the
+  // dividends paid before expiry. Finite differences take the dividends
+  // themselves and keep base.
+  marketObjects withEscrowedDividends(const marketObjects &base, const DividendSchedule &dividends){
+    if (dividends.empty())
+      return base;
+
+    Real escrowedSpot = base.underlying->value();
+    for (const ext::shared_ptr<Dividend> &dividend : dividends)
+      escrowedSpot -= dividend->amount() * base.bsmProcess->riskFreeRate()->discount(dividend->date());
+    QL_REQUIRE(escrowedSpot > 0.0, "dividends are worth more than the underlying");
+
+    marketObjects market = base;
+    market.underlying = makeShared<SimpleQuote>(escrowedSpot);
+    market.bsmProcess = makeShared<BlackScholesMertonProcess>(
+      Handle<Quote>(market.underlying),
+      base.bsmProcess->dividendYield(),
+      base.bsmProcess->riskFreeRate(),
+      base.bsmProcess->blackVolatility());
+
+    return market;
+  };
 
-    oP.request["NPV"]["Binomial-Jarrow-Rudd"] = bermudanOption.NPV();
-    oP.request["gamma"]["Binomial-Jarrow-Rudd"] = bermudanOption.gamma();
-    oP.request["delta"]["Binomial-Jarrow-Rudd"] = bermudanOption.delta();
-    oP.request["theta"]["Binomial-Jarrow-Rudd"] = bermudanOption.theta();
+  void addWeighted(optionGreeks &total, const optionGreeks &greeks, double weight){
+    total.NPV += weight * greeks.NPV;
+    total.delta += weight * greeks.delta;
+    total.gamma += weight * greeks.gamma;
+    total.vega += weight * greeks.vega;
+    total.theta += weight * greeks.theta;
+    total.rho += weight * greeks.rho;
+  };
 
-    bermudanOption.setPricingEngine(
-      ext::shared_ptr<PricingEngine>(
-        new BinomialVanillaEngine<CoxRossRubinstein>(
-          bsmProcess,
-          oP.timeSteps)));
+  json greeksToJson(const optionGreeks &greeks){
+    json result;
+    result["NPV"] = greeks.NPV;
+    result["delta"] = greeks.delta;
+    result["gamma"] = greeks.gamma;
+    result["vega"] = greeks.vega;
+    result["theta"] = greeks.theta;
+    result["rho"] = greeks.rho;
+    return result;
+  };
 
-    oP.request["NPV"]["Binomial-Cox-Ross-Rubinstein"] = bermudanOption.NPV();
-    oP.request["gamma"]["Binomial-Cox-Ross-Rubinstein"] = bermudanOption.gamma();
-    oP.request["delta"]["Binomial-Cox-Ross-Rubinstein"] = bermudanOption.delta();
-    oP.request["theta"]["Binomial-Cox-Ross-Rubinstein"] = bermudanOption.theta();
+  ext::shared_ptr<Exercise> makeExercise(int executionStyle,
+                                         const Date &settlementDate,
+                                         const Date &maturityDate){
+    switch(executionStyle)
+    {
+      case 0: return makeShared<EuropeanExercise>(maturityDate);
+      case 1: return makeShared<AmericanExercise>(settlementDate, maturityDate);
+      case 2: {
+        std::vector<Date> exerciseDates;
+        for (Integer i = 1; i <= 4; i++)
+          exerciseDates.push_back(settlementDate + 3 * i * Months);
+        return makeShared<BermudanExercise>(exerciseDates);
+      }
+      default: QL_FAIL("must submit excerise style");
+    };
+  };
 
-    bermudanOption.setPricingEngine(
-      ext::shared_ptr<PricingEngine>(
-        new BinomialVanillaEngine<AdditiveEQPBinomialTree>(
-          bsmProcess,
-          oP.timeSteps)));
+  // Names a request may use for a Bermudan exercise schedule rule.
+  template <class T>
+  struct namedValue {
+    const char *name;
+    T value;
+  };
 
-    oP.request["NPV"]["Additive-equiprobabilities"] = bermudanOption.NPV();
-    oP.request["gamma"]["Additive-equiprobabilities"] = bermudanOption.gamma();
-    oP.request["delta"]["Additive-equiprobabilities"] = bermudanOption.delta();
-    oP.request["theta"]["Additive-equiprobabilities"] = bermudanOption.theta();
+  const namedValue<Frequency> exerciseFrequencies[] = {
+    { "Annual", Annual }, { "Semiannual", Semiannual }, { "Quarterly", Quarterly },
+    { "Monthly", Monthly }, { "Weekly", Weekly }
+  };
 
-    bermudanOption.setPricingEngine(
-      ext::shared_ptr<PricingEngine>(
-        new BinomialVanillaEngine<Trigeorgis>(
-          bsmProcess,
-          oP.timeSteps)));
+  const namedValue<Size> exerciseCalendars[] = {
+    { "TARGET", 0 }, { "NullCalendar", 1 }, { "UnitedStates", 2 }
+  };
+
+  const namedValue<BusinessDayConvention> exerciseConventions[] = {
+    { "Following", Following }, { "ModifiedFollowing", ModifiedFollowing },
+    { "Preceding", Preceding }, { "ModifiedPreceding", ModifiedPreceding },
+    { "Unadjusted", Unadjusted }
+  };
 
-    oP.request["NPV"]["Binomial-Trigeorgis"] = bermudanOption.NPV();
-    oP.request["gamma"]["Binomial-Trigeorgis"]= bermudanOption.gamma();
-    oP.request["delta"]["Binomial-Trigeorgis"] = bermudanOption.delta();
-    oP.request["theta"]["Binomial-Trigeorgis"] = bermudanOption.theta();
+  template <class T, Size N>
+  bool findNamed(const namedValue<T> (&values)[N], const std::string &name, T &value){
+    for (const namedValue<T> &candidate : values)
+      if (name == candidate.name) {
+        value = candidate.value;
+        return true;
+      }
+    return false;
+  };
 
-    bermudanOption.setPricingEngine(
-      ext::shared_ptr<PricingEngine>(
-        new BinomialVanillaEngine<Tian>(
-          bsmProcess,
-          oP.timeSteps)));
+  Calendar makeCalendar(Size calendar){
+    switch (calendar) {
+      case 1: return NullCalendar();
+      case 2: return UnitedStates(UnitedStates::NYSE);
+      default: return TARGET();
+    }
+  };
 
-    oP.request["NPV"]["Heston-semi-analytic"] = bermudanOption.NPV();
-    oP.request["gamma"]["Heston-semi-analytic"] = bermudanOption.gamma();
-    oP.request["delta"]["Heston-semi-analytic"] = bermudanOption.delta();
-    oP.request["theta"]["Heston-semi-analytic"] = bermudanOption.theta();
+  // Bermudan exercises generated from a schedule rule, shared by every
+  // request on the same dates and rule whatever its strike. Emptied when
+  // it reaches capacity; a valuation date's worth of chains fits easily.
+  struct exerciseCache {
+    typedef std::tuple<Date::serial_type, Date::serial_type, int, Size, int> key;
+    static const Size capacity = 4096;
 
-    bermudanOption.setPricingEngine(
-      ext::shared_ptr<PricingEngine>(
-        new BinomialVanillaEngine<LeisenReimer>(
-        bsmProcess,
-        oP.timeSteps)));
+    std::mutex mutex;
+    std::map<key, ext::shared_ptr<Exercise> > entries;
+  };
 
-    oP.request["NPV"]["Binomial-Leisen-Reimer"] = bermudanOption.NPV();
-    oP.request["gamma"]["Binomial-Leisen-Reimer"] = bermudanOption.gamma();
-    oP.request["delta"]["Binomial-Leisen-Reimer"] = bermudanOption.delta();
-    oP.request["theta"]["Binomial-Leisen-Reimer"] = bermudanOption.theta();
+  exerciseCache &scheduleCache(){
+    static exerciseCache cache;
+    return cache;
+  };
 
-    bermudanOption.setPricingEngine(
-      ext::shared_ptr<PricingEngine>(
-        new BinomialVanillaEngine<Joshi4>(
-          bsmProcess,
-          oP.timeSteps)));
+  // The exercise of a request: the explicit exerciseDates or the schedule
+  // rule of a Bermudan request if it has one, and makeExercise's otherwise.
+  // Rule schedules run backward from maturity, which is always a date.
+  ext::shared_ptr<Exercise> requestExercise(const optionParameters &oP){
+    if (oP.executionStyle != 2 || (oP.exerciseDates.empty() && oP.exerciseFrequency == NoFrequency))
+      return makeExercise(oP.executionStyle, oP.settlementDate, oP.maturityDate);
+
+    if (!oP.exerciseDates.empty()) {
+      std::vector<Date> dates(oP.exerciseDates);
+      std::sort(dates.begin(), dates.end());
+      dates.erase(std::unique(dates.begin(), dates.end()), dates.end());
+      QL_REQUIRE(dates.front() > oP.settlementDate && dates.back() <= oP.maturityDate,
+                 "exerciseDates must fall after settlementDate and no later than maturityDate");
+      return makeShared<BermudanExercise>(dates);
+    }
 
-    oP.request["NPV"]["Binomial-Joshi"] = bermudanOption.NPV();
-    oP.request["gamma"]["Binomial-Joshi"] = bermudanOption.gamma();
-    oP.request["delta"]["Binomial-Joshi"] = bermudanOption.delta();
-    oP.request["theta"]["Binomial-Joshi"] = bermudanOption.theta();
+    const exerciseCache::key key(oP.settlementDate.serialNumber(), oP.maturityDate.serialNumber(),
+                                 int(oP.exerciseFrequency), oP.exerciseCalendar, int(oP.exerciseConvention));
+    exerciseCache &cache = scheduleCache();
+    {
+      std::lock_guard<std::mutex> lock(cache.mutex);
+      auto found = cache.entries.find(key);
+      if (found != cache.entries.end())
+        return found->second;
+    }
 
-    return oP.request.dump();
+    arenaSuspend suspend;
+    Schedule schedule(oP.settlementDate, oP.maturityDate, Period(oP.exerciseFrequency),
+                      makeCalendar(oP.exerciseCalendar), oP.exerciseConvention, Unadjusted,
+                      DateGeneration::Backward, false);
+    std::vector<Date> dates;
+    for (const Date &date : schedule.dates())
+      if (date > oP.settlementDate && date <= oP.maturityDate)
+        dates.push_back(date);
+    QL_REQUIRE(!dates.empty(), "the exercise schedule has no dates after settlementDate");
+    ext::shared_ptr<Exercise> exercise = makeShared<BermudanExercise>(dates);
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (cache.entries.size() >= exerciseCache::capacity)
+      cache.entries.clear();
+    cache.entries[key] = exercise;
+    return exercise;
   };
 
-  std::string calcuateOption(std::string data) {
-    try {
-      json request = json::parse(data);
+  // Tree depth for a Bermudan exercise. The trees step uniformly to the
+  // last exercise date and exercise at the step nearest each date, so a
+  // date between steps is exercised early or late. Of the step counts from
+  // requested down to half of it, this returns the largest that puts every
+  // date exactly on a step, or failing that the one that misses by least.
+  Size alignedTreeSteps(const Exercise &exercise, const Date &referenceDate, Size requested){
+    DayCounter dayCounter = Actual365Fixed();
+    const Time maturity = dayCounter.yearFraction(referenceDate, exercise.lastDate());
+    if (maturity <= 0.0 || requested < 2)
+      return requested;
+
+    std::vector<double> fractions;
+    for (const Date &date : exercise.dates())
+      fractions.push_back(dayCounter.yearFraction(referenceDate, date) / maturity);
+
+    Size best = requested;
+    double bestMiss = QL_MAX_REAL;
+    for (Size steps = requested; steps >= (requested + 1) / 2; steps--) {
+      double miss = 0.0;
+      for (double fraction : fractions)
+        miss = std::max(miss, std::fabs(fraction * steps - std::round(fraction * steps)));
+      if (miss < bestMiss - 1.0e-9) {
+        best = steps;
+        bestMiss = miss;
+        if (miss < 1.0e-9)
+          break;
+      }
+    }
+    return best;
+  };
 
-      optionParameters oP;
-
-      oP.todaysDate = Date(DateParser::parseISO(request["todaysDate"].get<std::string>()));
-      oP.settlementDate = Date(DateParser::parseISO(request["settlementDate"].get<std::string>()));
-      oP.type = Option::Type(request["optionType"].get<int>()); 
-      oP.underlying = request["underlying"];
-      oP.strike = request["strike"];
-      oP.dividendYield = request["dividendYield"];
-      oP.riskFreeRate = request["riskFreeRate"];
-      oP.maturityDate = DateParser::parseISO(request["maturityDate"].get<std::string>());
-      oP.optionPrice = request["optionPrice"];
-      oP.timeSteps = 801;
-      oP.request = request;
-
-      switch(request["executionStyle"].get<int>()) 
-      {
-        case 0: return calcuateEuropeanOption(oP);
-        case 1: return calcuateAmericanOption(oP);  
-        case 2: return calcuateBermudanOption(oP);
-        default: throw("must submit excerise style");
-      };
+  // Cash dividend schedules as sent by requests, one per underlying: every
+  // option on a stock carries the same dates and amounts whatever its strike
+  // or expiry, so the Dividend objects are built once and shared. Emptied
+  // when it reaches capacity, like the exercise cache.
+  struct dividendCache {
+    typedef std::vector<std::pair<Date::serial_type, double> > key;
+    static const Size capacity = 1024;
+
+    std::mutex mutex;
+    std::map<key, DividendSchedule> entries;
+  };
+
+  dividendCache &dividendSchedules(){
+    static dividendCache cache;
+    return cache;
+  };
+
+  // The dividends of a request paid during the option's life, after
+  // settlementDate and no later than maturityDate. The rest of the
+  // underlying's schedule stays cached for other expiries.
+  DividendSchedule requestDividends(const optionParameters &oP){
+    DividendSchedule paid;
+    if (oP.dividends.empty())
+      return paid;
+
+    dividendCache::key key;
+    key.reserve(oP.dividends.size());
+    for (const std::pair<Date, double> &dividend : oP.dividends)
+      key.emplace_back(dividend.first.serialNumber(), dividend.second + 0.0);
+
+    DividendSchedule schedule;
+    dividendCache &cache = dividendSchedules();
+    {
+      std::lock_guard<std::mutex> lock(cache.mutex);
+      auto found = cache.entries.find(key);
+      if (found != cache.entries.end())
+        schedule = found->second;
     }
 
-    catch (std::exception &e) { return e.what(); }
-    catch (...) { return "unknown error"; }
+    if (schedule.empty()) {
+      arenaSuspend suspend;
+      std::vector<Date> dates;
+      std::vector<Real> amounts;
+      for (const std::pair<Date, double> &dividend : oP.dividends) {
+        dates.push_back(dividend.first);
+        amounts.push_back(dividend.second);
+      }
+      schedule = DividendVector(dates, amounts);
+
+      std::lock_guard<std::mutex> lock(cache.mutex);
+      if (cache.entries.size() >= dividendCache::capacity)
+        cache.entries.clear();
+      cache.entries.emplace(key, schedule);
+    }
+
+    for (const ext::shared_ptr<Dividend> &dividend : schedule)
+      if (dividend->date() > oP.settlementDate && dividend->date() <= oP.maturityDate)
+        paid.push_back(dividend);
+    return paid;
   };
 
-  EMSCRIPTEN_BINDINGS(quantlib) { emscripten::function("calcuateOption", &calcuateOption); }
+  // FdBlackScholesVanillaEngine takes a dividend schedule from QuantLib 1.30
+  // on; against older versions finite differences get the escrowed process
+  // like the other engines.
+#if QL_HEX_VERSION >= 0x011e0000
+  constexpr bool finiteDifferenceDividends = true;
+#else
+  constexpr bool finiteDifferenceDividends = false;
+#endif
+
+  // Engines by the names used as keys in the NPV/delta/gamma/theta maps.
+  // Finite differences take cash dividends as jumps where QuantLib allows
+  // it; its solver lands a step on every ex-date, so they cost no extra
+  // time steps. The other engines price dividends through
+  // withEscrowedDividends' process.
+  ext::shared_ptr<PricingEngine> makeEngine(const std::string &engine,
+                                            const ext::shared_ptr<BlackScholesMertonProcess> &bsmProcess,
+                                            Size timeSteps,
+                                            const DividendSchedule &dividends = DividendSchedule()){
+    if (engine == "Black-Scholes")
+      return makeShared<AnalyticEuropeanEngine>(bsmProcess);
+    if (engine == "Finite-Differences") {
+#if QL_HEX_VERSION >= 0x011e0000
+      return makeShared<FdBlackScholesVanillaEngine>(bsmProcess, dividends, timeSteps, timeSteps - 1);
+#else
+      QL_REQUIRE(dividends.empty(), "this QuantLib's finite-difference engine takes no dividends");
+      return makeShared<FdBlackScholesVanillaEngine>(bsmProcess, timeSteps, timeSteps - 1);
+#endif
+    }
+    if (engine == "Binomial-Jarrow-Rudd")
+      return makeShared<BinomialVanillaEngine<cancellableTree<JarrowRudd> > >(bsmProcess, timeSteps);
+    if (engine == "Binomial-Cox-Ross-Rubinstein")
+      return makeShared<BinomialVanillaEngine<cancellableTree<CoxRossRubinstein> > >(bsmProcess, timeSteps);
+    if (engine == "Additive-equiprobabilities")
+      return makeShared<BinomialVanillaEngine<cancellableTree<AdditiveEQPBinomialTree> > >(bsmProcess, timeSteps);
+    if (engine == "Binomial-Trigeorgis")
+      return makeShared<BinomialVanillaEngine<cancellableTree<Trigeorgis> > >(bsmProcess, timeSteps);
+    if (engine == "Binomial-Tian")
+      return makeShared<BinomialVanillaEngine<cancellableTree<Tian> > >(bsmProcess, timeSteps);
+    if (engine == "Binomial-Leisen-Reimer")
+      return makeShared<BinomialVanillaEngine<cancellableTree<LeisenReimer> > >(bsmProcess, timeSteps);
+    if (engine == "Binomial-Joshi")
+      return makeShared<BinomialVanillaEngine<cancellableTree<Joshi4> > >(bsmProcess, timeSteps);
+    if (engine == "Barone-Adesi-Whaley")
+      return makeShared<BaroneAdesiWhaleyApproximationEngine>(bsmProcess);
+    QL_FAIL("unknown engine " << engine);
+  };
+
+  // Process-wide switch for one-shot pricing; see pricingContext.
+  std::atomic<bool> &oneShotPricing(){
+    static std::atomic<bool> enabled(false);
+    return enabled;
+  };
+
+  // Holds the evaluation date for the QuantLib work done on this thread
+  // while it is alive. With QL_ENABLE_SESSIONS every thread has its own
+  // Settings, so the context just sets the date. Otherwise the date is
+  // global: contexts for the same date run side by side, and a context for
+  // another date waits until they have all ended. Contexts nest on one
+  // thread as long as the date does not change.
+  //
+  // A one-shot context also turns off observer notifications, for callers
+  // that build their objects, price once and throw them away. Notifications
+  // are global in the same way as the date, so one-shot and notifying
+  // contexts never overlap.
+  class pricingContext {
+  public:
+    explicit pricingContext(const Date &todaysDate, bool oneShot = false, bool inherited = false)
+    : todaysDate(todaysDate), oneShot(oneShot), previous(active()) {
+      QL_REQUIRE(!previous || (previous->todaysDate == todaysDate && previous->oneShot == oneShot),
+                 "a nested pricing context cannot change the evaluation date or notifications");
+#if defined(OPTIONS_THREADS) && !defined(QL_ENABLE_SESSIONS)
+      holding = !previous && !inherited;
+      if (holding) {
+        globalDate &shared = sharedDate();
+        std::unique_lock<std::mutex> lock(shared.mutex);
+        auto compatible = [&]() { return shared.date == todaysDate && shared.oneShot == oneShot; };
+        // Once anyone is waiting, newcomers queue behind them until the
+        // contexts in use have drained, so no date is starved.
+        if (shared.users != 0 && (!compatible() || shared.waiting != 0)) {
+          const Size drained = shared.drained;
+          shared.waiting++;
+          shared.released.wait(lock, [&]() {
+            return shared.users == 0 || (compatible() && shared.drained != drained);
+          });
+          shared.waiting--;
+        }
+        if (shared.users++ == 0) {
+          if (shared.date != todaysDate) {
+            shared.date = todaysDate;
+            Settings::instance().evaluationDate() = todaysDate;
+          }
+          shared.oneShot = oneShot;
+          if (oneShot)
+            ObservableSettings::instance().disableUpdates(false);
+        }
+      }
+#else
+      (void)inherited;
+      if (!previous) {
+        Settings::instance().evaluationDate() = todaysDate;
+        if (oneShot)
+          ObservableSettings::instance().disableUpdates(false);
+      }
+#endif
+      active() = this;
+    }
+
+    ~pricingContext() {
+      active() = previous;
+#if defined(OPTIONS_THREADS) && !defined(QL_ENABLE_SESSIONS)
+      if (holding) {
+        globalDate &shared = sharedDate();
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        if (--shared.users == 0) {
+          if (shared.oneShot)
+            ObservableSettings::instance().enableUpdates();
+          shared.drained++;
+          shared.released.notify_all();
+        }
+      }
+#else
+      if (!previous && oneShot)
+        ObservableSettings::instance().enableUpdates();
+#endif
+    }
+
+    pricingContext(const pricingContext&) = delete;
+    pricingContext& operator=(const pricingContext&) = delete;
+
+    // The innermost context on this thread, if any; parallelFor hands it on
+    // to its workers.
+    static const pricingContext *current() {
+      return active();
+    }
+
+    const Date todaysDate;
+    const bool oneShot;
+
+  private:
+    static pricingContext *&active() {
+      thread_local pricingContext *context = nullptr;
+      return context;
+    }
+
+#if defined(OPTIONS_THREADS) && !defined(QL_ENABLE_SESSIONS)
+    struct globalDate {
+      std::mutex mutex;
+      std::condition_variable released;
+      Date date;
+      bool oneShot = false;
+      Size users = 0, waiting = 0, drained = 0;
+    };
+
+    static globalDate &sharedDate() {
+      static globalDate shared;
+      return shared;
+    }
+
+    bool holding = false;
+#endif
+
+    pricingContext *const previous;
+  };
+
+  // Runs work(0) .. work(count - 1), spread over the available cores (or
+  // maxWorkers threads) when the build has threads. The first exception
+  // thrown by any item is rethrown on the calling thread once all workers
+  // have stopped. Workers run under the caller's pricing context.
+  void parallelFor(Size count, const std::function<void(Size)> &work, Size maxWorkers = 0){
+#ifdef OPTIONS_THREADS
+    if (maxWorkers == 0)
+      maxWorkers = std::max(1u, std::thread::hardware_concurrency());
+    Size workers = std::min<Size>(count, maxWorkers);
+    if (workers > 1) {
+      std::atomic<Size> next(0);
+      std::exception_ptr failure;
+      std::mutex failureMutex;
+      const pricingContext *parent = pricingContext::current();
+      auto run = [&]() {
+        std::unique_ptr<pricingContext> context;
+        if (parent && !pricingContext::current())
+          context.reset(new pricingContext(parent->todaysDate, parent->oneShot, true));
+        for (Size i = next++; i < count; i = next++) {
+          try { work(i); }
+          catch (...) {
+            std::lock_guard<std::mutex> lock(failureMutex);
+            if (!failure) failure = std::current_exception();
+            next = count;
+          }
+        }
+      };
+      std::vector<std::thread> threads;
+      for (Size t = 1; t < workers; t++)
+        threads.emplace_back(run);
+      run();
+      for (auto &t : threads)
+        t.join();
+      if (failure)
+        std::rethrow_exception(failure);
+      return;
+    }
+#endif
+    for (Size i = 0; i < count; i++)
+      work(i);
+  };
+
+#ifdef OPTIONS_THREADS
+  // Fixed-capacity MPMC queue used by the native worker pools. push blocks
+  // while full, tryPush does not; pop blocks until an item arrives or the
+  // queue is closed and drained.
+  template <class T>
+  struct boundedQueue {
+    explicit boundedQueue(Size capacity) : capacity(capacity) {}
+
+    bool push(T item) {
+      std::unique_lock<std::mutex> lock(mutex);
+      notFull.wait(lock, [&]() { return closed || items.size() < capacity; });
+      if (closed)
+        return false;
+      items.push_back(std::move(item));
+      notEmpty.notify_one();
+      return true;
+    }
+
+    bool tryPush(T &item) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (closed || items.size() >= capacity)
+        return false;
+      items.push_back(std::move(item));
+      notEmpty.notify_one();
+      return true;
+    }
+
+    bool pop(T &item) {
+      std::unique_lock<std::mutex> lock(mutex);
+      notEmpty.wait(lock, [&]() { return closed || !items.empty(); });
+      if (items.empty())
+        return false;
+      item = std::move(items.front());
+      items.pop_front();
+      notFull.notify_one();
+      return true;
+    }
+
+    void close() {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+      notEmpty.notify_all();
+      notFull.notify_all();
+    }
+
+    const Size capacity;
+    std::mutex mutex;
+    std::condition_variable notEmpty, notFull;
+    std::deque<T> items;
+    bool closed = false;
+  };
+#endif
+
+  // Backward FD solve of a vanilla payoff on a log-spot mesh spanning
+  // [xMin, xMax]; the returned solver can be read at any spot in range.
+  ext::shared_ptr<FdmBlackScholesSolver> makeFdSolver(
+      const ext::shared_ptr<GeneralizedBlackScholesProcess> &process,
+      const ext::shared_ptr<StrikedTypePayoff> &payoff,
+      const ext::shared_ptr<Exercise> &exercise,
+      Real xMin,
+      Real xMax,
+      Size timeSteps){
+
+    const Date referenceDate = process->riskFreeRate()->referenceDate();
+    const DayCounter dayCounter = process->riskFreeRate()->dayCounter();
+    const Time maturity = dayCounter.yearFraction(referenceDate, exercise->lastDate());
+
+    ext::shared_ptr<Fdm1dMesher> equityMesher(
+      makeShared<FdmBlackScholesMesher>(
+        timeSteps - 1,
+        process,
+        maturity,
+        payoff->strike(),
+        xMin,
+        xMax,
+        0.0001,
+        1.5,
+        std::pair<Real, Real>(payoff->strike(), 0.1)));
+
+    ext::shared_ptr<FdmMesher> mesher(makeShared<FdmMesherComposite>(equityMesher));
+
+    ext::shared_ptr<FdmInnerValueCalculator> calculator(
+      makeShared<FdmLogInnerValue>(payoff, mesher, 0));
+
+    ext::shared_ptr<FdmStepConditionComposite> conditions =
+      FdmStepConditionComposite::vanillaComposite(
+        DividendSchedule(), exercise, mesher, calculator, referenceDate, dayCounter);
+
+    FdmSolverDesc solverDesc = {
+      mesher, FdmBoundaryConditionSet(), conditions, calculator, maturity, timeSteps, 0 };
+
+    return makeShared<FdmBlackScholesSolver>(
+      Handle<GeneralizedBlackScholesProcess>(process), payoff->strike(), solverDesc);
+  };
+
+  // Black-Scholes on the flat curves of a European request, evaluated the
+  // way AnalyticEuropeanEngine and BlackCalculator do for a plain vanilla
+  // payoff but without building any QuantLib objects, so nothing touches
+  // the heap. Returns false for requests the engine would reject or treat
+  // as expired; those take the full QuantLib path, which reports them.
+  bool europeanClosedForm(const optionParameters &oP, optionGreeks &greeks, double &thetaPerDay){
+
+    const double spot = oP.underlying;
+    const double strike = oP.strike;
+    const double volatility = oP.optionPrice;
+    if ((oP.type != Option::Call && oP.type != Option::Put)
+        || oP.maturityDate <= oP.todaysDate || oP.maturityDate < oP.settlementDate
+        || !(spot > 0.0) || !(strike >= 0.0) || !(volatility >= 0.0))
+      return false;
+
+    // Actual/365 (Fixed) from the curves' reference date, and continuously
+    // compounded flat rates as in FlatForward.
+    const Time t = Real(oP.maturityDate - oP.settlementDate) / 365.0;
+    const DiscountFactor riskFreeDiscount = 1.0 / std::exp(oP.riskFreeRate * t);
+    const DiscountFactor dividendDiscount = 1.0 / std::exp(oP.dividendYield * t);
+    const Real forward = spot * dividendDiscount / riskFreeDiscount;
+    const Real variance = volatility * volatility * t;
+    const Real stdDev = std::sqrt(variance);
+    if (!(forward > 0.0) || !(riskFreeDiscount > 0.0))
+      return false;
+
+    Real d1, d2, cumD1, cumD2, nD1, nD2;
+    if (stdDev >= QL_EPSILON) {
+      if (QuantLib::close(strike, 0.0)) {
+        d1 = d2 = QL_MAX_REAL;
+        cumD1 = cumD2 = 1.0;
+        nD1 = nD2 = 0.0;
+      } else {
+        CumulativeNormalDistribution f;
+        d1 = std::log(forward / strike) / stdDev + 0.5 * stdDev;
+        d2 = d1 - stdDev;
+        cumD1 = f(d1);
+        cumD2 = f(d2);
+        nD1 = f.derivative(d1);
+        nD2 = f.derivative(d2);
+      }
+    } else if (QuantLib::close(forward, strike)) {
+      d1 = d2 = 0.0;
+      cumD1 = cumD2 = 0.5;
+      nD1 = nD2 = M_SQRT_2 * M_1_SQRTPI;
+    } else if (forward > strike) {
+      d1 = d2 = QL_MAX_REAL;
+      cumD1 = cumD2 = 1.0;
+      nD1 = nD2 = 0.0;
+    } else {
+      d1 = d2 = QL_MIN_REAL;
+      cumD1 = cumD2 = 0.0;
+      nD1 = nD2 = 0.0;
+    }
+
+    const bool call = oP.type == Option::Call;
+    const Real alpha = call ? cumD1 : -1.0 + cumD1;
+    const Real beta = call ? -cumD2 : 1.0 - cumD2;
+    const Real dAlphaDd1 = nD1;
+    const Real dBetaDd2 = -nD2;
+
+    const Real dForwardDs = forward / spot;
+    const Real dAlphaDs = dAlphaDd1 / (stdDev * spot);
+    const Real dBetaDs = dBetaDd2 / (stdDev * spot);
+    const Real d2AlphaDs2 = -dAlphaDs / spot * (1 + d1 / stdDev);
+    const Real d2BetaDs2 = -dBetaDs / spot * (1 + d2 / stdDev);
+    const Real logMoneyness = std::log(strike / forward) / variance;
+
+    greeks.NPV = riskFreeDiscount * (forward * alpha + strike * beta);
+    greeks.delta = riskFreeDiscount * (dAlphaDs * forward + alpha * dForwardDs + dBetaDs * strike);
+    greeks.gamma = riskFreeDiscount * (d2AlphaDs2 * forward + 2.0 * dAlphaDs * dForwardDs
+                                       + d2BetaDs2 * strike);
+    greeks.vega = riskFreeDiscount * std::sqrt(t)
+                  * (dAlphaDd1 * (logMoneyness + 0.5) * forward + dBetaDd2 * (logMoneyness - 0.5) * strike);
+    greeks.rho = t * (riskFreeDiscount * (dAlphaDd1 / stdDev * forward + alpha * forward
+                                          + dBetaDd2 / stdDev * strike) - greeks.NPV);
+    greeks.theta = QuantLib::close(t, 0.0) ? 0.0
+      : -(std::log(riskFreeDiscount) * greeks.NPV + std::log(forward / spot) * spot * greeks.delta
+          + 0.5 * variance * spot * spot * greeks.gamma) / t;
+    thetaPerDay = greeks.theta / 365.0;
+    return true;
+  };
+
+  // The AnalyticEuropeanEngine branch, for requests the closed form does not
+  // take.
+  json analyticEuropeanOption(optionParameters &oP){
+
+    profileTimer setup(oP.profile, "setup");
+    Calendar calendar = TARGET();
+    DayCounter dayCounter = Actual365Fixed();
+    pricingContext context(oP.todaysDate, oneShotPricing());
+    Volatility impliedVolatility(oP.optionPrice);
+
+    recordResult(oP, "ImpliedVolatility", nullptr, impliedVolatility);
+
+    ext::shared_ptr<Exercise> europeanExercise(
+      makeShared<EuropeanExercise>(oP.maturityDate));
+
+    Handle<Quote> underlyingH(
+      ext::shared_ptr<Quote>(
+        makeShared<SimpleQuote>(
+          oP.underlying)));
+
+    Handle<YieldTermStructure> flatTermStructure(
+      ext::shared_ptr<YieldTermStructure>(
+        makeShared<FlatForward>(
+          oP.settlementDate,
+          oP.riskFreeRate,
+          dayCounter)));
+
+    Handle<YieldTermStructure> flatDividendTS(
+      ext::shared_ptr<YieldTermStructure>(
+        makeShared<FlatForward>(
+          oP.settlementDate,
+          oP.dividendYield,
+          dayCounter)));
+
+    Handle<BlackVolTermStructure> flatVolTS(
+      ext::shared_ptr<BlackVolTermStructure>(
+        makeShared<BlackConstantVol>(
+          oP.settlementDate,
+          calendar,
+          impliedVolatility, 
+          dayCounter)));
+
+    ext::shared_ptr<StrikedTypePayoff> payoff(
+      makeShared<PlainVanillaPayoff>(
+        oP.type,
+        oP.strike));
+
+    ext::shared_ptr<BlackScholesMertonProcess> bsmProcess(
+      makeShared<BlackScholesMertonProcess>(
+        underlyingH,
+        flatDividendTS,
+        flatTermStructure,
+        flatVolTS));
+
+    VanillaOption europeanOption(payoff, europeanExercise);
+    setup.stop();
+
+    engineTimer timer(oP.profile, "Black-Scholes", "Black-Scholes");
+    europeanOption.setPricingEngine(
+      ext::shared_ptr<PricingEngine>(
+        makeShared<AnalyticEuropeanEngine>(bsmProcess)));
+
+    recordResult(oP, "NPV", "Black-Scholes", europeanOption.NPV());
+    recordResult(oP, "gamma", "Black-Scholes", europeanOption.gamma());
+    recordResult(oP, "delta", "Black-Scholes", europeanOption.delta());
+    recordResult(oP, "rho", "Black-Scholes", europeanOption.rho());
+    recordResult(oP, "vega", "Black-Scholes", europeanOption.vega());
+    recordResult(oP, "theta", "Black-Scholes", europeanOption.theta());
+    recordResult(oP, "thetaPerDay", "Black-Scholes", europeanOption.thetaPerDay());
+
+    return oP.request;
+  };
+
+  json calcuateEuropeanOption(optionParameters &oP){
+
+    optionGreeks greeks;
+    double thetaPerDay;
+    engineTimer timer(oP.profile, "Black-Scholes", "Black-Scholes");
+    if (!europeanClosedForm(oP, greeks, thetaPerDay)) {
+      timer.discard();
+      return analyticEuropeanOption(oP);
+    }
+
+    recordResult(oP, "ImpliedVolatility", nullptr, oP.optionPrice);
+    recordResult(oP, "NPV", "Black-Scholes", greeks.NPV);
+    recordResult(oP, "gamma", "Black-Scholes", greeks.gamma);
+    recordResult(oP, "delta", "Black-Scholes", greeks.delta);
+    recordResult(oP, "rho", "Black-Scholes", greeks.rho);
+    recordResult(oP, "vega", "Black-Scholes", greeks.vega);
+    recordResult(oP, "theta", "Black-Scholes", greeks.theta);
+    recordResult(oP, "thetaPerDay", "Black-Scholes", thetaPerDay);
+
+    return oP.request;
+  };
+
+  // Engines priced for American and Bermudan requests, keyed by the label
+  // used in the response. The Bermudan labels keep their original spelling,
+  // including "Heston-semi-analytic" for the Tian tree, so callers reading
+  // those keys are unaffected.
+  struct labelledEngine {
+    const char *label;
+    const char *engine;
+  };
+
+  const labelledEngine americanEngines[] = {
+    { "Finite-Differences", "Finite-Differences" },
+    { "Binomial-Jarrow-Rudd", "Binomial-Jarrow-Rudd" },
+    { "Binomial-Cox-Ross-Rubinstein", "Binomial-Cox-Ross-Rubinstein" },
+    { "Additive-equiprobabilities", "Additive-equiprobabilities" },
+    { "Binomial-Trigeorgis", "Binomial-Trigeorgis" },
+    { "Binomial-Tian", "Binomial-Tian" },
+    { "Binomial-Leisen-Reimer", "Binomial-Leisen-Reimer" },
+    { "Binomial-Joshi", "Binomial-Joshi" }
+  };
+
+  const labelledEngine bermudanEngines[] = {
+    { "Finite-differences", "Finite-Differences" },
+    { "Binomial-Jarrow-Rudd", "Binomial-Jarrow-Rudd" },
+    { "Binomial-Cox-Ross-Rubinstein", "Binomial-Cox-Ross-Rubinstein" },
+    { "Additive-equiprobabilities", "Additive-equiprobabilities" },
+    { "Binomial-Trigeorgis", "Binomial-Trigeorgis" },
+    { "Heston-semi-analytic", "Binomial-Tian" },
+    { "Binomial-Leisen-Reimer", "Binomial-Leisen-Reimer" },
+    { "Binomial-Joshi", "Binomial-Joshi" }
+  };
+
+  // Hands the results so far to a streaming request's progress callback.
+  void reportProgress(const optionParameters &oP, const json &partial){
+    if (oP.progress)
+      (*oP.progress)(partial);
+  };
+
+  // Prices one option under each engine in turn, writing NPV, delta, gamma
+  // and theta under the engine's label. A streaming request sees the
+  // results after every engine but the last, and for an American option a
+  // Barone-Adesi-Whaley estimate before the first.
+  template <Size N>
+  json calcuateWithEngines(optionParameters &oP, const labelledEngine (&engines)[N]){
+
+    profileTimer setup(oP.profile, "setup");
+    pricingContext context(oP.todaysDate, oneShotPricing());
+    recordResult(oP, "ImpliedVolatility", nullptr, oP.optionPrice);
+
+    marketObjects market = makeMarketObjects(
+      oP.settlementDate, oP.underlying, oP.optionPrice, oP.riskFreeRate, oP.dividendYield,
+      oP.riskFreeCurve);
+
+    const DividendSchedule dividends = requestDividends(oP);
+    const marketObjects escrowed = withEscrowedDividends(market, dividends);
+
+    const ext::shared_ptr<Exercise> exercise = requestExercise(oP);
+    VanillaOption option(makeShared<PlainVanillaPayoff>(oP.type, oP.strike), exercise);
+    // FD steps onto every exercise date exactly; the trees need the help.
+    const Size treeSteps = oP.executionStyle == 2
+      ? alignedTreeSteps(*exercise, oP.settlementDate, Size(oP.timeSteps)) : Size(oP.timeSteps);
+    setup.stop();
+
+    if (oP.progress && oP.executionStyle == 1) {
+      const char *estimator = "Barone-Adesi-Whaley";
+      engineTimer timer(oP.profile, estimator, estimator);
+      option.setPricingEngine(makeEngine(estimator, escrowed.bsmProcess, 0));
+      json estimate = oP.request;
+      estimate["NPV"][estimator] = option.NPV();
+      reportProgress(oP, estimate);
+    }
+
+    for (const labelledEngine &engine : engines) {
+      pricingCheckpoint();
+      {
+        engineTimer timer(oP.profile, engine.label, engine.engine);
+        const bool finiteDifferences = std::strcmp(engine.engine, "Finite-Differences") == 0;
+        if (finiteDifferences && finiteDifferenceDividends)
+          option.setPricingEngine(makeEngine(engine.engine, market.bsmProcess, Size(oP.timeSteps), dividends));
+        else if (finiteDifferences)
+          option.setPricingEngine(makeEngine(engine.engine, escrowed.bsmProcess, Size(oP.timeSteps)));
+        else
+          option.setPricingEngine(makeEngine(engine.engine, escrowed.bsmProcess, treeSteps));
+        recordResult(oP, "NPV", engine.label, option.NPV());
+        recordResult(oP, "gamma", engine.label, option.gamma());
+        recordResult(oP, "delta", engine.label, option.delta());
+        recordResult(oP, "theta", engine.label, option.theta());
+      }
+      if (&engine != &engines[N - 1])
+        reportProgress(oP, oP.request);
+    }
+
+    return oP.request;
+  };
+
+  json calcuateAmericanOption(optionParameters &oP){
+    return calcuateWithEngines(oP, americanEngines);
+  };
+
+  json calcuateBermudanOption(optionParameters &oP){
+    return calcuateWithEngines(oP, bermudanEngines);
+  };
+
+  typedef std::pair<const char*, const char*> resultName;
+
+  template <Size N>
+  void engineResultNames(const labelledEngine (&engines)[N], std::vector<resultName> &names){
+    for (const char *field : { "NPV", "gamma", "delta", "theta" })
+      for (const labelledEngine &engine : engines)
+        names.push_back(resultName(field, engine.label));
+  };
+
+  // Every (field, engine) result priceOption records for an execution style
+  // without a deadline, known before pricing anything; engine is null for
+  // ImpliedVolatility. Empty for a style priceOption rejects.
+  std::vector<resultName> resultNames(int executionStyle){
+    std::vector<resultName> names;
+    if (executionStyle < 0 || executionStyle > 2)
+      return names;
+    names.push_back(resultName("ImpliedVolatility", nullptr));
+    if (executionStyle == 0)
+      for (const char *field : { "NPV", "gamma", "delta", "rho", "vega", "theta", "thetaPerDay" })
+        names.push_back(resultName(field, "Black-Scholes"));
+    else if (executionStyle == 1)
+      engineResultNames(americanEngines, names);
+    else
+      engineResultNames(bermudanEngines, names);
+    return names;
+  };
+
+  // What the deadline path expects to spend: one Barone-Adesi-Whaley price,
+  // and a Leisen-Reimer tree per squared time step. Measured by pricing a
+  // reference American option; costModel() does that once, on first use,
+  // and warmUp() gets it done ahead of the first request.
+  struct latticeCostModel {
+    double approximationMicros;
+    double microsPerStepSquared;
+  };
+
+  latticeCostModel calibrateCostModel(){
+    const Date todaysDate(15, May, 1998), settlementDate(17, May, 1998), maturityDate(17, May, 1999);
+    pricingContext context(todaysDate, oneShotPricing());
+    marketObjects market = makeMarketObjects(settlementDate, 36.0, 0.2, 0.06, 0.01);
+    VanillaOption option(
+      makeShared<PlainVanillaPayoff>(Option::Put, 40.0),
+      makeExercise(1, settlementDate, maturityDate));
+
+    const Size calibrationSteps = 201, repeats = 5;
+    auto averageMicros = [&](const ext::shared_ptr<PricingEngine> &engine) {
+      option.setPricingEngine(engine);
+      option.NPV();
+      const std::int64_t start = profileClock();
+      for (Size i = 0; i < repeats; i++) {
+        option.setPricingEngine(engine);
+        option.NPV();
+      }
+      return double(profileClock() - start) / 1000.0 / double(repeats);
+    };
+
+    latticeCostModel model;
+    model.approximationMicros = averageMicros(makeEngine("Barone-Adesi-Whaley", market.bsmProcess, 0));
+    // Floored so that a coarse clock (the browser's is) cannot make the
+    // tree look free.
+    model.microsPerStepSquared = std::max(1.0e-6, averageMicros(
+      makeEngine("Binomial-Leisen-Reimer", market.bsmProcess, calibrationSteps))
+      / double(calibrationSteps * calibrationSteps));
+    return model;
+  };
+
+  const latticeCostModel &costModel(){
+    static const latticeCostModel model = calibrateCostModel();
+    return model;
+  };
+
+  // Prices an American or Bermudan request within its deadlineMicros,
+  // counted from when the request arrived. American options get the
+  // Barone-Adesi-Whaley approximation first; a Leisen-Reimer tree then
+  // refines it with as many steps (up to timeSteps) as the cost model says
+  // fit in the time left. Bermudan options always get a tree, at least
+  // minimumSteps deep. deliveredEngine and deliveredTimeSteps name the
+  // result to use; 0 steps means the approximation.
+  json calcuateWithinDeadline(optionParameters &oP){
+
+    const Size minimumSteps = 25;
+    const double safetyFactor = 0.8;
+    const latticeCostModel &model = costModel();
+
+    profileTimer setup(oP.profile, "setup");
+    pricingContext context(oP.todaysDate, oneShotPricing());
+    recordResult(oP, "ImpliedVolatility", nullptr, oP.optionPrice);
+
+    marketObjects market = makeMarketObjects(
+      oP.settlementDate, oP.underlying, oP.optionPrice, oP.riskFreeRate, oP.dividendYield,
+      oP.riskFreeCurve);
+
+    const marketObjects escrowed = withEscrowedDividends(market, requestDividends(oP));
+
+    const ext::shared_ptr<Exercise> exercise = requestExercise(oP);
+    VanillaOption option(makeShared<PlainVanillaPayoff>(oP.type, oP.strike), exercise);
+    setup.stop();
+
+    const char *delivered = nullptr;
+    if (oP.executionStyle == 1) {
+      delivered = "Barone-Adesi-Whaley";
+      {
+        engineTimer timer(oP.profile, delivered, delivered);
+        option.setPricingEngine(makeEngine(delivered, escrowed.bsmProcess, 0));
+        recordResult(oP, "NPV", delivered, option.NPV());
+      }
+      reportProgress(oP, oP.request);
+    }
+
+    const double remainingMicros =
+      oP.deadlineMicros - double(profileClock() - oP.received) / 1000.0;
+    const double affordableSteps =
+      std::sqrt(std::max(0.0, safetyFactor * remainingMicros) / model.microsPerStepSquared);
+    Size steps = affordableSteps < oP.timeSteps ? Size(affordableSteps) : Size(oP.timeSteps);
+    if (steps >= minimumSteps || !delivered) {
+      pricingCheckpoint();
+      steps = std::max(steps, minimumSteps);
+      if (oP.executionStyle == 2)
+        steps = alignedTreeSteps(*exercise, oP.settlementDate, steps);
+      delivered = "Binomial-Leisen-Reimer";
+      engineTimer timer(oP.profile, delivered, delivered);
+      option.setPricingEngine(makeEngine(delivered, escrowed.bsmProcess, steps));
+      recordResult(oP, "NPV", delivered, option.NPV());
+      recordResult(oP, "gamma", delivered, option.gamma());
+      recordResult(oP, "delta", delivered, option.delta());
+      recordResult(oP, "theta", delivered, option.theta());
+    } else {
+      steps = 0;
+    }
+
+    oP.request["deliveredEngine"] = delivered;
+    oP.request["deliveredTimeSteps"] = steps;
+    return oP.request;
+  };
+
+  optionParameters parseOptionParameters(const json &request){
+
+    optionParameters oP;
+
+    oP.executionStyle = request.at("executionStyle").get<int>();
+    oP.todaysDate = Date(DateParser::parseISO(request.at("todaysDate").get<std::string>()));
+    oP.settlementDate = Date(DateParser::parseISO(request.at("settlementDate").get<std::string>()));
+    oP.type = Option::Type(request.at("optionType").get<int>()); 
+    oP.underlying = request.at("underlying");
+    oP.strike = request.at("strike");
+    oP.dividendYield = request.at("dividendYield");
+    oP.riskFreeRate = request.at("riskFreeRate");
+    oP.maturityDate = DateParser::parseISO(request.at("maturityDate").get<std::string>());
+    oP.optionPrice = request.at("optionPrice");
+    oP.timeSteps = 801;
+    oP.request = request;
+
+    return oP;
+  };
+
+  // Fields of a calcuateOption request, in the order they are echoed.
+  enum optionField {
+    executionStyleField, optionTypeField, todaysDateField, settlementDateField,
+    maturityDateField, underlyingField, strikeField, dividendYieldField,
+    riskFreeRateField, optionPriceField, fieldsField, layoutField, profileField,
+    deadlineField, requestIdField, exerciseDatesField, exerciseFrequencyField,
+    exerciseCalendarField, exerciseConventionField, dividendsField, riskFreeCurveField,
+    optionFieldCount
+  };
+
+  constexpr const char *optionFieldNames[optionFieldCount] = {
+    "executionStyle", "optionType", "todaysDate", "settlementDate",
+    "maturityDate", "underlying", "strike", "dividendYield",
+    "riskFreeRate", "optionPrice", "fields", "layout", "profile", "deadlineMicros",
+    "requestId", "exerciseDates", "exerciseFrequency", "exerciseCalendar", "exerciseConvention",
+    "dividends", "riskFreeCurve"
+  };
+
+  // Everything before fieldsField is a pricing input: required, and echoed
+  // back in the response.
+  constexpr Size echoedFieldCount = fieldsField;
+  constexpr unsigned requiredOptionFields = (1u << echoedFieldCount) - 1;
+
+  // Names a "fields" projection may select: the echoed inputs, in
+  // optionField order, followed by the results.
+  constexpr const char *resultFieldNames[] = {
+    "NPV", "delta", "gamma", "vega", "theta", "thetaPerDay", "rho", "ImpliedVolatility",
+    "deliveredEngine", "deliveredTimeSteps"
+  };
+  constexpr Size resultFieldCount = sizeof(resultFieldNames) / sizeof(resultFieldNames[0]);
+
+  // A request naming a riskFreeCurve has it echoed in riskFreeRate's place,
+  // so either name selects that slot.
+  int findResponseField(const std::string &name){
+    if (name == optionFieldNames[riskFreeCurveField])
+      return int(riskFreeRateField);
+    for (Size f = 0; f < echoedFieldCount; f++)
+      if (name == optionFieldNames[f])
+        return int(f);
+    for (Size f = 0; f < resultFieldCount; f++)
+      if (name == resultFieldNames[f])
+        return int(echoedFieldCount + f);
+    return -1;
+  };
+
+  // Seeded FNV-1a into 64 slots. The seed is chosen so that every field
+  // name lands in its own slot; the static_assert below fails the build if
+  // a new field collides, in which case pick another seed.
+  constexpr std::uint32_t fieldHashSeed = 14;
+  constexpr Size fieldSlots = 64;
+
+  constexpr Size fieldHash(const char *name, Size length){
+    std::uint32_t hash = fieldHashSeed;
+    for (Size i = 0; i < length; i++)
+      hash = (hash ^ std::uint8_t(name[i])) * 16777619u;
+    return hash % fieldSlots;
+  };
+
+  constexpr Size fieldLength(const char *name){
+    Size length = 0;
+    while (name[length])
+      length++;
+    return length;
+  };
+
+  struct fieldTable {
+    signed char slots[fieldSlots];
+    bool perfect;
+  };
+
+  constexpr fieldTable makeFieldTable(){
+    fieldTable table = {};
+    table.perfect = true;
+    for (Size i = 0; i < fieldSlots; i++)
+      table.slots[i] = -1;
+    for (Size f = 0; f < optionFieldCount; f++) {
+      Size slot = fieldHash(optionFieldNames[f], fieldLength(optionFieldNames[f]));
+      if (table.slots[slot] != -1)
+        table.perfect = false;
+      table.slots[slot] = static_cast<signed char>(f);
+    }
+    return table;
+  };
+
+  constexpr fieldTable optionFieldTable = makeFieldTable();
+  static_assert(optionFieldTable.perfect, "request field names collide; change fieldHashSeed");
+
+  int findOptionField(const std::string &name){
+    const int field = optionFieldTable.slots[fieldHash(name.data(), name.size())];
+    if (field < 0 || name.size() != fieldLength(optionFieldNames[field])
+        || name.compare(optionFieldNames[field]) != 0)
+      return -1;
+    return field;
+  };
+
+  // SAX handler that writes a flat calcuateOption request straight into
+  // optionParameters. No DOM is built: keys are dispatched through the
+  // perfect hash above and values are stored as they are read. Unknown,
+  // duplicate, nested or mistyped fields stop the parse at that token; the
+  // only objects allowed inside the request are the dividends entries.
+  struct optionRequestHandler : nlohmann::json_sax<json> {
+    enum { dividendDate = 1, dividendAmount = 2 };
+
+    optionParameters &oP;
+    std::string error;
+    int field = -1;
+    unsigned seen = 0;
+    Size depth = 0;
+    bool inArray = false;
+    bool inDividend = false;
+    unsigned dividendKey = 0;
+    unsigned dividendKeys = 0;
+    std::string riskFreeCurve;
+
+    explicit optionRequestHandler(optionParameters &oP) : oP(oP) {}
+
+    bool fail(const char *message) {
+      error = field >= 0
+        ? std::string("field ") + optionFieldNames[field] + " " + message
+        : std::string(message);
+      return false;
+    }
+
+    // Where a dividends value may go: into the current entry, under its key.
+    bool dividendValue(unsigned expected, const char *mistyped) {
+      if (!inArray)
+        return fail("must be an array");
+      if (!inDividend)
+        return fail("must list objects with date and amount");
+      return dividendKey == expected || fail(mistyped);
+    }
+
+    bool number(double value, bool integral) {
+      switch (field) {
+        case executionStyleField:
+        case optionTypeField:
+          if (!integral)
+            return fail("must be an integer");
+          // Checked on the double, before int() could overflow.
+          if (field == executionStyleField) {
+            if (value != 0.0 && value != 1.0 && value != 2.0)
+              return fail("must be 0 (European), 1 (American) or 2 (Bermudan)");
+            oP.executionStyle = int(value);
+          } else {
+            if (value != 1.0 && value != -1.0)
+              return fail("must be 1 (call) or -1 (put)");
+            oP.type = Option::Type(int(value));
+          }
+          break;
+        case underlyingField: oP.underlying = value; break;
+        case strikeField: oP.strike = value; break;
+        case dividendYieldField: oP.dividendYield = value; break;
+        case riskFreeRateField: oP.riskFreeRate = value; break;
+        case optionPriceField: oP.optionPrice = value; break;
+        case fieldsField: return fail(inArray ? "must list field names" : "must be an array");
+        case exerciseDatesField: return fail(inArray ? "must list date strings" : "must be an array");
+        case dividendsField:
+          if (!dividendValue(dividendAmount, "dates must be YYYY-MM-DD strings"))
+            return false;
+          if (!(value > 0.0))
+            return fail("amounts must be positive");
+          oP.dividends.back().second = value;
+          return true;
+        case riskFreeCurveField:
+        case exerciseFrequencyField:
+        case exerciseCalendarField:
+        case exerciseConventionField:
+        case layoutField: return fail("must be a string");
+        case profileField: return fail("must be a boolean");
+        case requestIdField: return fail("must be a string");
+        case deadlineField:
+          if (!(value > 0.0))
+            return fail("must be positive");
+          oP.deadlineMicros = value;
+          return true;
+        default: return fail("must be a date string");
+      }
+      if (integral)
+        oP.integerFields |= 1u << field;
+      return true;
+    }
+
+    bool null() override { return fail("must not be null"); }
+    bool boolean(bool value) override {
+      if (field != profileField || inArray)
+        return fail("must not be a boolean");
+      oP.profileRequested = value;
+      return true;
+    }
+    bool number_integer(number_integer_t value) override { return number(double(value), true); }
+    bool number_unsigned(number_unsigned_t value) override { return number(double(value), true); }
+    bool number_float(number_float_t value, const string_t &) override { return number(value, false); }
+    bool binary(binary_t &) override { return fail("must not be binary"); }
+
+    bool string(string_t &value) override {
+      if (inArray && field == fieldsField) {
+        const int selected = findResponseField(value);
+        if (selected < 0)
+          return fail(("cannot select " + value).c_str());
+        oP.responseFields |= std::uint32_t(1) << selected;
+        return true;
+      }
+      if (field == exerciseFrequencyField)
+        return findNamed(exerciseFrequencies, value, oP.exerciseFrequency)
+          || fail("must be Annual, Semiannual, Quarterly, Monthly or Weekly");
+      if (field == exerciseCalendarField)
+        return findNamed(exerciseCalendars, value, oP.exerciseCalendar)
+          || fail("must be TARGET, NullCalendar or UnitedStates");
+      if (field == exerciseConventionField)
+        return findNamed(exerciseConventions, value, oP.exerciseConvention)
+          || fail("must be Following, ModifiedFollowing, Preceding, ModifiedPreceding or Unadjusted");
+      if (field == layoutField) {
+        if (value != "named" && value != "compact")
+          return fail("must be \"named\" or \"compact\"");
+        oP.compactLayout = value == "compact";
+        return true;
+      }
+      if (field == riskFreeCurveField) {
+        riskFreeCurve = value;
+        return true;
+      }
+      if (field == dividendsField) {
+        if (!dividendValue(dividendDate, "amounts must be numbers"))
+          return false;
+        try { oP.dividends.back().first = DateParser::parseISO(value); }
+        catch (...) { return fail("dates must be YYYY-MM-DD strings"); }
+        return true;
+      }
+      if ((field == fieldsField || field == exerciseDatesField) && !inArray)
+        return fail("must be an array");
+      if (field == profileField)
+        return fail("must be a boolean");
+      if (field == deadlineField)
+        return fail("must be a number");
+      if (field == requestIdField) {
+        oP.requestId = value;
+        return true;
+      }
+      if (field != todaysDateField && field != settlementDateField && field != maturityDateField
+          && field != exerciseDatesField)
+        return fail("must be a number");
+      Date date;
+      try { date = DateParser::parseISO(value); }
+      catch (...) { return fail(inArray ? "must list YYYY-MM-DD dates" : "must be a YYYY-MM-DD date"); }
+      switch (field) {
+        case todaysDateField: oP.todaysDate = date; break;
+        case settlementDateField: oP.settlementDate = date; break;
+        case exerciseDatesField: oP.exerciseDates.push_back(date); break;
+        default: oP.maturityDate = date; break;
+      }
+      return true;
+    }
+
+    bool start_object(std::size_t) override {
+      if (depth == 1 && inArray && field == dividendsField && !inDividend) {
+        depth++;
+        inDividend = true;
+        dividendKey = dividendKeys = 0;
+        oP.dividends.emplace_back(Date(), 0.0);
+        return true;
+      }
+      return depth++ == 0 ? true : fail("must not be an object");
+    }
+
+    bool end_object() override {
+      depth--;
+      if (inDividend) {
+        inDividend = false;
+        if (dividendKeys != (dividendDate | dividendAmount))
+          return fail("entries need a date and an amount");
+      }
+      return true;
+    }
+
+    bool start_array(std::size_t) override {
+      if (depth == 0)
+        return fail("request must be an object");
+      if ((field != fieldsField && field != exerciseDatesField && field != dividendsField) || inArray)
+        return fail("must not be an array");
+      inArray = true;
+      if (field == fieldsField)
+        oP.responseFields = 0;
+      return true;
+    }
+
+    bool end_array() override {
+      inArray = false;
+      return true;
+    }
+
+    bool key(string_t &name) override {
+      if (inDividend) {
+        dividendKey = name == "date" ? dividendDate : name == "amount" ? dividendAmount : 0;
+        if (!dividendKey || (dividendKeys & dividendKey))
+          return fail("entries take one date and one amount");
+        dividendKeys |= dividendKey;
+        return true;
+      }
+      field = findOptionField(name);
+      if (field < 0) {
+        error = "unknown field " + name;
+        return false;
+      }
+      if (seen & (1u << field))
+        return fail("appears twice");
+      seen |= 1u << field;
+      return true;
+    }
+
+    bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception &e) override {
+      error = e.what();
+      return false;
+    }
+  };
+
+  std::string isoDate(const Date &date){
+    char text[11];
+    std::snprintf(text, sizeof(text), "%04d-%02d-%02d",
+                  int(date.year()), int(date.month()), int(date.dayOfMonth()));
+    return text;
+  };
+
+  // The curve loadYieldCurve stored under name for todaysDate.
+  yieldCurveRegistry::entry findYieldCurve(const std::string &name, const Date &todaysDate){
+    yieldCurveRegistry &registry = yieldCurves();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    auto found = registry.curves.find(std::make_pair(name, todaysDate.serialNumber()));
+    QL_REQUIRE(found != registry.curves.end(),
+               "no riskFreeCurve " << name << " loaded for " << isoDate(todaysDate));
+    return found->second;
+  };
+
+  template <class Input>
+  optionParameters parseOptionRequest(Input &&input, nlohmann::detail::input_format_t format){
+
+    optionParameters oP;
+    oP.received = profileClock();
+    optionRequestHandler handler(oP);
+
+    const bool parsed = json::sax_parse(std::forward<Input>(input), &handler, format);
+    QL_REQUIRE(parsed, handler.error);
+    QL_REQUIRE(handler.depth == 0 && handler.seen != 0, "request must be an object");
+    const bool curveNamed = handler.seen & (1u << riskFreeCurveField);
+    const unsigned requiredFields = curveNamed
+      ? requiredOptionFields & ~(1u << riskFreeRateField) : requiredOptionFields;
+    for (Size f = 0; f < echoedFieldCount; f++)
+      QL_REQUIRE((handler.seen & (1u << f)) || !(requiredFields & (1u << f)),
+                 "missing field " << optionFieldNames[f]);
+
+    // A named curve stands in for riskFreeRate: the engines get the whole
+    // curve, and riskFreeRate becomes its zero rate from settlement to
+    // maturity, which is all the European closed form needs.
+    if (curveNamed) {
+      QL_REQUIRE(!(handler.seen & (1u << riskFreeRateField)),
+                 "give either riskFreeRate or riskFreeCurve, not both");
+      const yieldCurveRegistry::entry found = findYieldCurve(handler.riskFreeCurve, oP.todaysDate);
+      const ext::shared_ptr<pillarCurve> curve = found.curve;
+      oP.riskFreeCurveGeneration = found.generation;
+
+      oP.riskFreeCurve = curve;
+      oP.riskFreeCurveName = handler.riskFreeCurve;
+      const Time t = Real(oP.maturityDate - oP.settlementDate) / 365.0;
+      oP.riskFreeRate = t > 0.0
+        ? std::log(curve->discountOn(oP.settlementDate) / curve->discountOn(oP.maturityDate)) / t
+        : 0.0;
+    }
+
+    const unsigned exerciseFields = (1u << exerciseDatesField) | (1u << exerciseFrequencyField)
+                                  | (1u << exerciseCalendarField) | (1u << exerciseConventionField);
+    if (handler.seen & exerciseFields) {
+      QL_REQUIRE(oP.executionStyle == 2, "exercise schedules apply to Bermudan options only");
+      QL_REQUIRE(!(handler.seen & (1u << exerciseDatesField)) || !oP.exerciseDates.empty(),
+                 "field exerciseDates must not be empty");
+      QL_REQUIRE(oP.exerciseDates.empty() || oP.exerciseFrequency == NoFrequency,
+                 "give either exerciseDates or exerciseFrequency, not both");
+      QL_REQUIRE(!oP.exerciseDates.empty() || oP.exerciseFrequency != NoFrequency,
+                 "exerciseCalendar and exerciseConvention need exerciseFrequency");
+    }
+    if (handler.seen & (1u << dividendsField)) {
+      QL_REQUIRE(oP.executionStyle == 1 || oP.executionStyle == 2,
+                 "dividends apply to American and Bermudan options only");
+      std::sort(oP.dividends.begin(), oP.dividends.end());
+    }
+
+    oP.timeSteps = 801;
+    oP.request = json::object();
+    return oP;
+  };
+
+  // Rebuilds the request object for the response from the parsed fields
+  // selected by the projection; numbers sent as integers are echoed as
+  // integers.
+  json echoRequest(const optionParameters &oP){
+    json request = json::object();
+    const double numbers[echoedFieldCount] = {
+      double(oP.executionStyle), double(oP.type), 0.0, 0.0, 0.0,
+      oP.underlying, oP.strike, oP.dividendYield, oP.riskFreeRate, oP.optionPrice };
+    for (Size f = 0; f < echoedFieldCount; f++) {
+      if (!(oP.responseFields & (std::uint32_t(1) << f))) continue;
+      if (f == todaysDateField) request[optionFieldNames[f]] = isoDate(oP.todaysDate);
+      else if (f == settlementDateField) request[optionFieldNames[f]] = isoDate(oP.settlementDate);
+      else if (f == maturityDateField) request[optionFieldNames[f]] = isoDate(oP.maturityDate);
+      else if (f == riskFreeRateField && oP.riskFreeCurve)
+        request[optionFieldNames[riskFreeCurveField]] = oP.riskFreeCurveName;
+      else if (oP.integerFields & (1u << f)) request[optionFieldNames[f]] = std::int64_t(numbers[f]);
+      else request[optionFieldNames[f]] = numbers[f];
+    }
+    return request;
+  };
+
+  // Optional LRU memo of priced results. Keys are the pricing inputs of a
+  // request, so key order and number formatting do not matter; entries hold
+  // only the fields the pricer added and are merged onto the echoed request
+  // on a hit. Entries expire when a newer todaysDate is seen.
+  struct resultCache {
+    struct entry {
+      std::string key;
+      Date todaysDate;
+      json result;
+    };
+
+    std::mutex mutex;
+    std::list<entry> entries;
+    std::unordered_map<std::string, std::list<entry>::iterator> index;
+    Size capacity = 0;
+    Date newestDate;
+    unsigned long long hits = 0, misses = 0, evictions = 0, expirations = 0;
+
+    bool enabled() {
+      std::lock_guard<std::mutex> lock(mutex);
+      return capacity > 0;
+    }
+
+    void expire(const Date &todaysDate) {
+      if (newestDate != Date() && todaysDate <= newestDate)
+        return;
+      newestDate = todaysDate;
+      for (auto it = entries.begin(); it != entries.end();) {
+        if (it->todaysDate < newestDate) {
+          index.erase(it->key);
+          it = entries.erase(it);
+          expirations++;
+        } else {
+          ++it;
+        }
+      }
+    }
+
+    bool find(const std::string &key, const Date &todaysDate, json &result) {
+      std::lock_guard<std::mutex> lock(mutex);
+      expire(todaysDate);
+      auto found = index.find(key);
+      if (found == index.end()) {
+        misses++;
+        return false;
+      }
+      entries.splice(entries.begin(), entries, found->second);
+      result = found->second->result;
+      hits++;
+      return true;
+    }
+
+    void insert(const std::string &key, const Date &todaysDate, json result) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (capacity == 0 || todaysDate < newestDate || index.count(key))
+        return;
+      entries.push_front(entry{key, todaysDate, std::move(result)});
+      index[key] = entries.begin();
+      while (entries.size() > capacity) {
+        index.erase(entries.back().key);
+        entries.pop_back();
+        evictions++;
+      }
+    }
+
+    void resize(Size newCapacity) {
+      std::lock_guard<std::mutex> lock(mutex);
+      capacity = newCapacity;
+      while (entries.size() > capacity) {
+        index.erase(entries.back().key);
+        entries.pop_back();
+        evictions++;
+      }
+    }
+  };
+
+  resultCache &requestCache(){
+    static resultCache cache;
+    return cache;
+  };
+
+  // Fixed-width binary image of the pricing inputs. Adding 0.0 folds -0.0
+  // into 0.0 so that both spellings share an entry.
+  std::string cacheKey(const optionParameters &oP){
+    const double numbers[] = {
+      oP.strike + 0.0, oP.underlying + 0.0, oP.optionPrice + 0.0,
+      oP.dividendYield + 0.0, oP.riskFreeRate + 0.0, oP.timeSteps + 0.0, oP.deadlineMicros + 0.0 };
+    const Date::serial_type dates[] = {
+      oP.todaysDate.serialNumber(), oP.settlementDate.serialNumber(), oP.maturityDate.serialNumber() };
+    const int styles[] = { oP.executionStyle, int(oP.type), int(oP.exerciseFrequency),
+                           int(oP.exerciseCalendar), int(oP.exerciseConvention) };
+
+    std::string key;
+    const std::uint32_t dividendCount = std::uint32_t(oP.dividends.size());
+    key.reserve(sizeof(numbers) + sizeof(dates) + sizeof(styles)
+                + sizeof(oP.riskFreeCurveGeneration) + sizeof(dividendCount)
+                + oP.dividends.size() * (sizeof(Date::serial_type) + sizeof(double))
+                + oP.exerciseDates.size() * sizeof(Date::serial_type));
+    key.append(reinterpret_cast<const char*>(numbers), sizeof(numbers));
+    key.append(reinterpret_cast<const char*>(dates), sizeof(dates));
+    key.append(reinterpret_cast<const char*>(styles), sizeof(styles));
+    key.append(reinterpret_cast<const char*>(&oP.riskFreeCurveGeneration), sizeof(oP.riskFreeCurveGeneration));
+    key.append(reinterpret_cast<const char*>(&dividendCount), sizeof(dividendCount));
+    for (const std::pair<Date, double> &dividend : oP.dividends) {
+      const Date::serial_type serial = dividend.first.serialNumber();
+      const double amount = dividend.second + 0.0;
+      key.append(reinterpret_cast<const char*>(&serial), sizeof(serial));
+      key.append(reinterpret_cast<const char*>(&amount), sizeof(amount));
+    }
+    for (const Date &date : oP.exerciseDates) {
+      const Date::serial_type serial = date.serialNumber();
+      key.append(reinterpret_cast<const char*>(&serial), sizeof(serial));
+    }
+    return key;
+  };
+
+  std::atomic<unsigned long long> coalescedRequests(0);
+}
+
+// Named rather than anonymous: each front end that includes this file calls
+// only some of the entry points, and the rest would warn as unused.
+namespace optionsApi
+{
+  void setCacheCapacity(Size capacity){
+    requestCache().resize(capacity);
+  };
+
+  std::string getCacheStats(){
+    resultCache &cache = requestCache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    json stats;
+    stats["capacity"] = cache.capacity;
+    stats["size"] = cache.entries.size();
+    stats["hits"] = cache.hits;
+    stats["misses"] = cache.misses;
+    stats["evictions"] = cache.evictions;
+    stats["expirations"] = cache.expirations;
+    stats["coalesced"] = coalescedRequests.load();
+    return stats.dump();
+  };
+
+  // The metrics registry, cache and arena counters in the Prometheus text
+  // exposition format. Latencies are summaries in seconds with p50, p99 and
+  // p99.9 taken from the histograms.
+  std::string getMetrics(){
+
+    std::ostringstream out;
+    out.precision(9);
+    const pricingMetrics &registry = metrics();
+    const double quantiles[] = { 0.5, 0.99, 0.999 };
+
+    auto summary = [&](const char *name, const std::string &labels, const latencyHistogram &latency) {
+      for (double q : quantiles)
+        out << name << "{" << labels << ",quantile=\"" << q << "\"} " << latency.quantile(q) * 1e-9 << "\n";
+      out << name << "_sum{" << labels << "} " << latency.total() * 1e-9 << "\n";
+      out << name << "_count{" << labels << "} " << latency.samples() << "\n";
+    };
+
+    out << "# HELP options_requests_total Requests answered, by execution style.\n"
+        << "# TYPE options_requests_total counter\n";
+    for (Size i = 0; i < styleCount; i++)
+      out << "options_requests_total{style=\"" << styleNames[i] << "\"} " << registry.requests[i].load() << "\n";
+    out << "# HELP options_request_errors_total Requests that failed, by execution style.\n"
+        << "# TYPE options_request_errors_total counter\n";
+    for (Size i = 0; i < styleCount; i++)
+      out << "options_request_errors_total{style=\"" << styleNames[i] << "\"} " << registry.errors[i].load() << "\n";
+    out << "# HELP options_request_duration_seconds Request latency, by execution style.\n"
+        << "# TYPE options_request_duration_seconds summary\n";
+    for (Size i = 0; i < styleCount; i++)
+      summary("options_request_duration_seconds", std::string("style=\"") + styleNames[i] + "\"", registry.requestLatency[i]);
+
+    out << "# HELP options_engine_calls_total Engine evaluations, by engine.\n"
+        << "# TYPE options_engine_calls_total counter\n";
+    for (Size i = 0; i < engineCount; i++)
+      out << "options_engine_calls_total{engine=\"" << engineNames[i] << "\"} " << registry.engines[i].calls.load() << "\n";
+    out << "# HELP options_engine_errors_total Engine evaluations that threw, by engine.\n"
+        << "# TYPE options_engine_errors_total counter\n";
+    for (Size i = 0; i < engineCount; i++)
+      out << "options_engine_errors_total{engine=\"" << engineNames[i] << "\"} " << registry.engines[i].errors.load() << "\n";
+    out << "# HELP options_engine_duration_seconds Engine latency, by engine.\n"
+        << "# TYPE options_engine_duration_seconds summary\n";
+    for (Size i = 0; i < engineCount; i++)
+      summary("options_engine_duration_seconds", std::string("engine=\"") + engineNames[i] + "\"", registry.engines[i].latency);
+
+    {
+      resultCache &cache = requestCache();
+      std::lock_guard<std::mutex> lock(cache.mutex);
+      const unsigned long long lookups = cache.hits + cache.misses;
+      out << "# TYPE options_cache_hits_total counter\n"
+          << "options_cache_hits_total " << cache.hits << "\n"
+          << "# TYPE options_cache_misses_total counter\n"
+          << "options_cache_misses_total " << cache.misses << "\n"
+          << "# TYPE options_cache_evictions_total counter\n"
+          << "options_cache_evictions_total " << cache.evictions << "\n"
+          << "# TYPE options_cache_expirations_total counter\n"
+          << "options_cache_expirations_total " << cache.expirations << "\n"
+          << "# HELP options_cache_hit_ratio Hits over lookups since start.\n"
+          << "# TYPE options_cache_hit_ratio gauge\n"
+          << "options_cache_hit_ratio " << (lookups ? double(cache.hits) / double(lookups) : 0.0) << "\n"
+          << "# TYPE options_cache_entries gauge\n"
+          << "options_cache_entries " << cache.entries.size() << "\n";
+    }
+    out << "# TYPE options_coalesced_requests_total counter\n"
+        << "options_coalesced_requests_total " << coalescedRequests.load() << "\n";
+
+    const allocationTotals &allocations = arenaTotals();
+    out << "# HELP options_arena_scopes_total Requests run in an arena scope.\n"
+        << "# TYPE options_arena_scopes_total counter\n"
+        << "options_arena_scopes_total " << allocations.scopes.load() << "\n"
+        << "# HELP options_arena_allocations_total Blocks allocated from request arenas.\n"
+        << "# TYPE options_arena_allocations_total counter\n"
+        << "options_arena_allocations_total " << allocations.blocks.load() << "\n"
+        << "# HELP options_arena_allocated_bytes_total Bytes allocated from request arenas.\n"
+        << "# TYPE options_arena_allocated_bytes_total counter\n"
+        << "options_arena_allocated_bytes_total " << allocations.bytes.load() << "\n";
+
+    return out.str();
+  };
+
+  // Writes getMetrics() to path through a temporary file and a rename, so a
+  // collector never reads a partial file.
+  bool writeMetrics(std::string path){
+    const std::string temporary = path + ".tmp";
+    std::FILE *file = std::fopen(temporary.c_str(), "w");
+    if (!file)
+      return false;
+    const std::string text = getMetrics();
+    const bool written = std::fwrite(text.data(), 1, text.size(), file) == text.size();
+    if (std::fclose(file) != 0 || !written)
+      return false;
+    return std::rename(temporary.c_str(), path.c_str()) == 0;
+  };
+
+  // Caps the bytes a single request may allocate from its arena; a request
+  // that goes over fails with "request exceeded the memory limit". 0 turns
+  // the cap off.
+  void setRequestMemoryLimit(Size bytes){
+    requestMemoryLimit().store(bytes);
+  };
+
+  // Cancels every calcuateOption request in flight under requestId; they
+  // fail with "request cancelled" at their next checkpoint. Returns whether
+  // there was any.
+  bool cancel(const std::string &requestId){
+    cancellationRegistry &registry = cancellations();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    auto found = registry.tokens.equal_range(requestId);
+    for (auto it = found.first; it != found.second; ++it)
+      it->second->store(true, std::memory_order_relaxed);
+    return found.first != found.second;
+  };
+
+  // Prices single-option requests with observer notifications turned off.
+  // Their QuantLib objects never see a market update, so the notifications
+  // are wasted work.
+  void setOneShotPricing(bool enabled){
+    oneShotPricing().store(enabled);
+  };
+
+  // Measures the cost model that deadlineMicros requests size their trees
+  // with, which the first such request would otherwise wait for. Returns
+  // false, having measured nothing, while a calcuateOptionAsync call is
+  // suspended.
+  bool warmUp(){
+    try {
+      refuseWhileSuspended();
+      costModel();
+      return true;
+    }
+    catch (...) { return false; }
+  };
+
+  // Loads a risk-free curve that calcuateOption requests on todaysDate may
+  // name in riskFreeCurve instead of giving riskFreeRate:
+  //   {"name": "USD", "todaysDate": "1998-05-15",
+  //    "pillars": [{"date": "1998-11-16", "zeroRate": 0.055},
+  //                {"date": "1999-05-17", "discountFactor": 0.946}]}
+  // Zero rates are continuously compounded Actual/365 (Fixed) from
+  // todaysDate. Returns a summary of the curve, or the error.
+  std::string loadYieldCurve(std::string data){
+    try {
+      refuseWhileSuspended();
+      const json request = json::parse(data);
+      const std::string name = request.at("name").get<std::string>();
+      const Date todaysDate = DateParser::parseISO(request.at("todaysDate").get<std::string>());
+      const json &pillars = request.at("pillars");
+      QL_REQUIRE(pillars.is_array() && !pillars.empty(), "pillars must be a non-empty array");
+
+      std::vector<Date> dates;
+      std::vector<DiscountFactor> factors;
+      for (const json &pillar : pillars) {
+        const Date date = DateParser::parseISO(pillar.at("date").get<std::string>());
+        QL_REQUIRE(date > (dates.empty() ? todaysDate : dates.back()),
+                   "pillar dates must ascend after todaysDate");
+        QL_REQUIRE(pillar.contains("zeroRate") != pillar.contains("discountFactor"),
+                   "each pillar needs either a zeroRate or a discountFactor");
+        const DiscountFactor factor = pillar.contains("zeroRate")
+          ? std::exp(-pillar["zeroRate"].get<double>() * Real(date - todaysDate) / 365.0)
+          : pillar["discountFactor"].get<double>();
+        QL_REQUIRE(factor > 0.0, "pillar discount factors must be positive");
+        dates.push_back(date);
+        factors.push_back(factor);
+      }
+
+      const ext::shared_ptr<pillarCurve> curve = makeShared<pillarCurve>(todaysDate, dates, factors);
+      yieldCurveRegistry &registry = yieldCurves();
+      {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.expire(todaysDate);
+        QL_REQUIRE(todaysDate == registry.newestDate,
+                   "curves for " << isoDate(registry.newestDate) << " have replaced those for "
+                   << isoDate(todaysDate));
+        yieldCurveRegistry::entry &entry = registry.curves[std::make_pair(name, todaysDate.serialNumber())];
+        entry.curve = curve;
+        entry.generation = ++registry.generations;
+      }
+
+      json summary;
+      summary["name"] = name;
+      summary["todaysDate"] = isoDate(todaysDate);
+      summary["pillars"] = dates.size();
+      return summary.dump();
+    }
+
+    catch (std::exception &e) { return e.what(); }
+    catch (...) { return "unknown error"; }
+  };
+
+  std::string getMemoryStats(){
+
+    const heapUsage heap = currentHeap();
+    raiseTo(peakHeapInUse(), heap.inUse);
+
+    json stats;
+    stats["heapInUse"] = heap.inUse;
+    stats["heapReserved"] = heap.reserved;
+    stats["peakHeapInUse"] = peakHeapInUse().load();
+#ifdef __EMSCRIPTEN__
+    stats["wasmMemory"] = std::uint64_t(emscripten_get_heap_size());
+#endif
+
+    json live = json::object();
+    for (Size i = 0; i < objectKindCount; i++)
+      live[objectKindNames[i]] = liveObjects()[i].load();
+    stats["liveObjects"] = std::move(live);
+
+    const allocationTotals &allocations = arenaTotals();
+    const std::uint64_t requests = allocations.scopes.load();
+    stats["requests"] = requests;
+    stats["lastRequestBytes"] = allocations.lastBytes.load();
+    stats["largestRequestBytes"] = allocations.largestBytes.load();
+    stats["averageRequestBytes"] = requests ? allocations.bytes.load() / requests : 0;
+    stats["requestMemoryLimit"] = requestMemoryLimit().load();
+    return stats.dump();
+  };
+}
+
+using namespace optionsApi;
+
+namespace
+{
+  json priceOption(optionParameters &oP){
+    switch(oP.executionStyle) 
+    {
+      case 0: return calcuateEuropeanOption(oP);
+      case 1: return oP.deadlineMicros > 0.0 ? calcuateWithinDeadline(oP) : calcuateAmericanOption(oP);
+      case 2: return oP.deadlineMicros > 0.0 ? calcuateWithinDeadline(oP) : calcuateBermudanOption(oP);
+      default: throw("must submit excerise style");
+    };
+  };
+
+  // Single-flight: while a key is being priced, later requests for the same
+  // key wait for that result instead of pricing it again.
+  json priceOnce(const std::string &key, const std::function<json()> &price){
+#ifdef OPTIONS_THREADS
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::shared_future<json> > inflight;
+
+    std::promise<json> promise;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      auto found = inflight.find(key);
+      if (found != inflight.end()) {
+        std::shared_future<json> pending = found->second;
+        lock.unlock();
+        coalescedRequests++;
+        return pending.get();
+      }
+      inflight[key] = promise.get_future().share();
+    }
+
+    auto finish = [&]() {
+      std::lock_guard<std::mutex> lock(mutex);
+      inflight.erase(key);
+    };
+
+    try {
+      json result = price();
+      {
+        arenaSuspend suspend;
+        promise.set_value(result);
+      }
+      finish();
+      return result;
+    }
+    catch (...) {
+      promise.set_exception(std::current_exception());
+      finish();
+      throw;
+    }
+#else
+    return price();
+#endif
+  };
+
+  // Lays out a response from the echoed inputs and the priced results. A
+  // "fields" projection keeps only the listed names. The compact layout
+  // lists the engines once and turns every per-engine map into an array in
+  // that order, with null where an engine does not provide the value.
+  json shapeResponse(const optionParameters &oP, const json &computed){
+
+    json response = echoRequest(oP);
+    json engines = json::array();
+    for (Size f = 0; f < resultFieldCount; f++) {
+      if (!(oP.responseFields & (std::uint32_t(1) << (echoedFieldCount + f))))
+        continue;
+      auto found = computed.find(resultFieldNames[f]);
+      if (found == computed.end())
+        continue;
+      response[resultFieldNames[f]] = *found;
+      if (oP.compactLayout && found->is_object())
+        for (auto &engine : found->items())
+          if (std::find(engines.begin(), engines.end(), engine.key()) == engines.end())
+            engines.push_back(engine.key());
+    }
+
+    if (oP.compactLayout && !engines.empty()) {
+      for (Size f = 0; f < resultFieldCount; f++) {
+        auto found = response.find(resultFieldNames[f]);
+        if (found == response.end() || !found->is_object())
+          continue;
+        json values = json::array();
+        for (auto &engine : engines) {
+          auto value = found->find(engine.get<std::string>());
+          values.push_back(value == found->end() ? json() : *value);
+        }
+        *found = std::move(values);
+      }
+      response["engines"] = std::move(engines);
+    }
+    return response;
+  };
+
+  // Prices a parsed calcuateOption request and returns the echoed request
+  // with the results added; shared by the text and binary entry points.
+  json respondToOption(optionParameters &oP){
+
+    profileTimer lookup(oP.profile, "cache");
+    const std::string key = cacheKey(oP);
+    const bool cached = requestCache().enabled();
+    json computed;
+    const bool hit = cached && requestCache().find(key, oP.todaysDate, computed);
+    lookup.stop();
+    if (!hit) {
+      cancellationScope cancellable(oP.requestId);
+      auto price = [&]() {
+        json result = priceOption(oP);
+        if (cached) {
+          arenaSuspend suspend;
+          requestCache().insert(key, oP.todaysDate, result);
+        }
+        return result;
+      };
+      // A cancellable request prices on its own: waiters sharing its
+      // result would be cancelled with it. So does a streaming one, which
+      // would otherwise wait without progress behind another pricing.
+      computed = oP.requestId.empty() && !oP.progress ? priceOnce(key, price) : price();
+    }
+
+    profileTimer shape(oP.profile, "shape");
+    return shapeResponse(oP, computed);
+  };
+
+  json profileToJson(const requestProfile &profile){
+    json timings = json::object();
+    for (auto &phase : profile.phases)
+      timings[phase.first] = phase.second;
+    json engines = json::object();
+    for (auto &engine : profile.engines)
+      engines[engine.first] = engine.second;
+    if (!engines.empty())
+      timings["engines"] = std::move(engines);
+    timings["total"] = profileClock() - profile.start;
+    return timings;
+  };
+
+  // Adds "name": value to the end of a serialized JSON object.
+  void appendMember(std::string &text, const char *name, const std::string &value){
+    text.pop_back();
+    text += text.size() > 1 ? ",\"" : "\"";
+    text += name;
+    text += "\":" + value + "}";
+  };
+
+  // The JSON text response to a parsed request, with its timings when it
+  // asked for a profile.
+  std::string respondToOptionText(optionParameters &oP, std::int64_t start){
+    if (!oP.profileRequested)
+      return respondToOption(oP).dump();
+
+    requestProfile profile(start);
+    profile.phases.push_back(std::make_pair("parse", profileClock() - start));
+    oP.profile = &profile;
+    const json response = respondToOption(oP);
+    profileTimer serialize(&profile, "serialize");
+    std::string text = response.dump();
+    serialize.stop();
+
+    // The timings go in after serialization so that they can include it.
+    appendMember(text, "timings", profileToJson(profile).dump());
+    return text;
+  };
+}
+
+namespace optionsApi
+{
+  std::string calcuateOption(std::string data) {
+    try {
+      refuseWhileSuspended();
+      arenaScope scope;
+      requestMetrics measured;
+      optionParameters oP = parseOptionRequest(data, nlohmann::detail::input_format_t::json);
+      measured.executionStyle(oP.executionStyle);
+      return respondToOptionText(oP, measured.start);
+    }
+
+    catch (std::exception &e) { return e.what(); }
+    catch (...) { return "unknown error"; }
+  };
+
+#ifdef OPTIONS_ASYNCIFY
+  // calcuateOption for the browser's main thread. Exported with
+  // emscripten::async(), so JavaScript gets a Promise; pricing yields at
+  // its checkpoints so that no stretch of work runs much past
+  // yieldIntervalMs. Asyncify can only suspend one call at a time, so a
+  // second call made before the first settles fails.
+  std::string calcuateOptionAsync(std::string data){
+    asyncYielding &state = yielding();
+    if (state.active)
+      return "another calcuateOptionAsync call is in flight";
+    state.active = true;
+    state.lastYield = emscripten_get_now();
+    std::string result = calcuateOption(data);
+    state.active = false;
+    return result;
+  };
+#elif !defined(__EMSCRIPTEN__)
+  // Native counterpart: prices on a thread of its own.
+  std::future<std::string> calcuateOptionAsync(std::string data){
+    return std::async(std::launch::async, calcuateOption, std::move(data));
+  };
+#endif
+
+  // calcuateOption that also passes emit a response after each engine: a
+  // cheap estimate first where there is one, then the results so far. Each
+  // carries "complete": false, except for the last, which is the response
+  // calcuateOption would give plus "complete": true. Returns that response
+  // without the flag, or the error.
+  std::string calcuateOptionStreaming(std::string data,
+                                      const std::function<void(const std::string&)> &emit) {
+    try {
+      refuseWhileSuspended();
+      arenaScope scope;
+      requestMetrics measured;
+      optionParameters oP = parseOptionRequest(data, nlohmann::detail::input_format_t::json);
+      measured.executionStyle(oP.executionStyle);
+      const std::function<void(const json&)> progress = [&](const json &partial) {
+        json response = shapeResponse(oP, partial);
+        response["complete"] = false;
+        emit(response.dump());
+      };
+      oP.progress = &progress;
+      const std::string text = respondToOptionText(oP, measured.start);
+      std::string last = text;
+      appendMember(last, "complete", "true");
+      emit(last);
+      return text;
+    }
+
+    catch (std::exception &e) { return e.what(); }
+    catch (...) { return "unknown error"; }
+  };
+}
+
+namespace
+{
+  enum class binaryEncoding { cbor, msgpack };
+
+  // Binary requests get binary replies, so failures come back encoded as
+  // {"error": "..."} rather than as a bare message.
+  std::vector<std::uint8_t> calcuateOptionBinary(const std::vector<std::uint8_t> &data,
+                                                 binaryEncoding encoding){
+    arenaScope scope;
+    json response;
+    try {
+      refuseWhileSuspended();
+      requestMetrics measured;
+      optionParameters oP = parseOptionRequest(
+        data,
+        encoding == binaryEncoding::cbor
+          ? nlohmann::detail::input_format_t::cbor
+          : nlohmann::detail::input_format_t::msgpack);
+      measured.executionStyle(oP.executionStyle);
+      if (oP.profileRequested) {
+        requestProfile profile(measured.start);
+        profile.phases.push_back(std::make_pair("parse", profileClock() - measured.start));
+        oP.profile = &profile;
+        response = respondToOption(oP);
+
+        // Binary encodings cannot be spliced, so the response is encoded
+        // once to time it and again with the timings.
+        profileTimer serialize(&profile, "serialize");
+        std::vector<std::uint8_t> timed = encoding == binaryEncoding::cbor
+          ? json::to_cbor(response) : json::to_msgpack(response);
+        serialize.stop();
+        response["timings"] = profileToJson(profile);
+      } else {
+        response = respondToOption(oP);
+      }
+    }
+    catch (std::exception &e) { response = json::object(); response["error"] = e.what(); }
+    catch (...) { response = json::object(); response["error"] = "unknown error"; }
+
+    return encoding == binaryEncoding::cbor ? json::to_cbor(response) : json::to_msgpack(response);
+  };
+
+  // One contract of a scenario grid: the request itself, or an entry of
+  // its "contracts" book. The spot, dates and rates are the request's.
+  struct gridContract {
+    int executionStyle;
+    Option::Type type;
+    double strike;
+    Date maturityDate;
+    double volatility;
+    double quantity;
+  };
+
+  gridContract parseGridContract(const json &entry){
+    gridContract contract;
+    contract.executionStyle = entry.at("executionStyle").get<int>();
+    QL_REQUIRE(contract.executionStyle >= 0 && contract.executionStyle <= 2,
+               "executionStyle must be 0 (European), 1 (American) or 2 (Bermudan)");
+    const int type = entry.at("optionType").get<int>();
+    QL_REQUIRE(type == 1 || type == -1, "optionType must be 1 (call) or -1 (put)");
+    contract.type = Option::Type(type);
+    contract.strike = entry.at("strike");
+    contract.maturityDate = DateParser::parseISO(entry.at("maturityDate").get<std::string>());
+    contract.volatility = entry.at("optionPrice");
+    contract.quantity = entry.value("quantity", 1.0);
+    return contract;
+  };
+
+  // Grids price without dividends, on the default exercise schedule;
+  // fields that would change that are refused rather than ignored.
+  void refuseGridFields(const json &entry){
+    for (const char *name : { "exerciseDates", "exerciseFrequency", "exerciseCalendar",
+                              "exerciseConvention", "dividends" })
+      QL_REQUIRE(!entry.contains(name), "calcuateScenarioGrid does not take " << name);
+  };
+}
+
+namespace optionsApi
+{
+  std::vector<std::uint8_t> calcuateOptionCBOR(const std::vector<std::uint8_t> &data){
+    return calcuateOptionBinary(data, binaryEncoding::cbor);
+  };
+
+  std::vector<std::uint8_t> calcuateOptionMsgPack(const std::vector<std::uint8_t> &data){
+    return calcuateOptionBinary(data, binaryEncoding::msgpack);
+  };
+
+  // Prices every leg of a spread/straddle/condor/calendar in one call. Legs
+  // with the same volatility share one set of quotes, curves and process,
+  // and legs with the same style share one engine instance. Vega and rho
+  // for lattice/FD legs come from a single bump of the shared quotes.
+  std::string calcuateStrategy(std::string data) {
+    try {
+      refuseWhileSuspended();
+      arenaScope scope;
+      json request = json::parse(data);
+
+      Date todaysDate = DateParser::parseISO(request["todaysDate"].get<std::string>());
+      Date settlementDate = DateParser::parseISO(request["settlementDate"].get<std::string>());
+      double underlying = request["underlying"];
+      double dividendYield = request["dividendYield"];
+      double riskFreeRate = request["riskFreeRate"];
+      double volatility = request["optionPrice"];
+      Size timeSteps = request.value("timeSteps", 801);
+      std::string latticeEngine = request.value("engine", std::string("Finite-Differences"));
+
+      pricingContext context(todaysDate);
+
+      struct strategyLeg {
+        ext::shared_ptr<VanillaOption> option;
+        Size market;
+        double quantity;
+        bool analytic;
+        optionGreeks greeks;
+      };
+
+      std::vector<marketObjects> markets;
+      std::map<double, Size> marketByVolatility;
+      std::map<std::pair<Size, std::string>, ext::shared_ptr<PricingEngine> > engines;
+      std::vector<strategyLeg> legs;
+
+      QL_REQUIRE(request["legs"].is_array() && !request["legs"].empty(),
+                 "must submit at least one leg");
+
+      for (auto &l : request["legs"]) {
+        double legVolatility = l.value("optionPrice", volatility);
+        auto found = marketByVolatility.find(legVolatility);
+        if (found == marketByVolatility.end()) {
+          markets.push_back(
+            makeMarketObjects(settlementDate, underlying, legVolatility, riskFreeRate, dividendYield));
+          found = marketByVolatility.insert(std::make_pair(legVolatility, markets.size() - 1)).first;
+        }
+
+        int executionStyle = l["executionStyle"].get<int>();
+        std::string engine = executionStyle == 0 ? std::string("Black-Scholes") : latticeEngine;
+        ext::shared_ptr<PricingEngine> &pricingEngine = engines[std::make_pair(found->second, engine)];
+        if (!pricingEngine)
+          pricingEngine = makeEngine(engine, markets[found->second].bsmProcess, timeSteps);
+
+        strategyLeg leg;
+        leg.option = makeShared<VanillaOption>(
+          makeShared<PlainVanillaPayoff>(Option::Type(l["optionType"].get<int>()), l["strike"].get<double>()),
+          makeExercise(
+            executionStyle,
+            settlementDate,
+            DateParser::parseISO(l["maturityDate"].get<std::string>())));
+        leg.option->setPricingEngine(pricingEngine);
+        leg.market = found->second;
+        leg.quantity = l.value("quantity", 1.0);
+        leg.analytic = engine == "Black-Scholes";
+        legs.push_back(leg);
+      }
+
+      for (auto &leg : legs) {
+        leg.greeks.NPV = leg.option->NPV();
+        leg.greeks.delta = leg.option->delta();
+        leg.greeks.gamma = leg.option->gamma();
+        leg.greeks.theta = leg.option->theta();
+        if (leg.analytic) {
+          leg.greeks.vega = leg.option->vega();
+          leg.greeks.rho = leg.option->rho();
+        }
+      }
+
+      const double volatilityBump = 1.0e-4, rateBump = 1.0e-4;
+      for (Size m = 0; m < markets.size(); m++) {
+        markets[m].volatility->setValue(markets[m].volatility->value() + volatilityBump);
+        for (auto &leg : legs)
+          if (leg.market == m && !leg.analytic)
+            leg.greeks.vega = (leg.option->NPV() - leg.greeks.NPV) / volatilityBump;
+        markets[m].volatility->setValue(markets[m].volatility->value() - volatilityBump);
+
+        markets[m].riskFreeRate->setValue(markets[m].riskFreeRate->value() + rateBump);
+        for (auto &leg : legs)
+          if (leg.market == m && !leg.analytic)
+            leg.greeks.rho = (leg.option->NPV() - leg.greeks.NPV) / rateBump;
+        markets[m].riskFreeRate->setValue(markets[m].riskFreeRate->value() - rateBump);
+      }
+
+      optionGreeks net;
+      for (Size i = 0; i < legs.size(); i++) {
+        json &l = request["legs"][i];
+        l.update(greeksToJson(legs[i].greeks));
+        addWeighted(net, legs[i].greeks, legs[i].quantity);
+      }
+
+      request["net"] = greeksToJson(net);
+
+      return request.dump();
+    }
+
+    catch (std::exception &e) { return e.what(); }
+    catch (...) { return "unknown error"; }
+  };
+
+  // PnL grid over relative spot shifts, absolute vol shifts and calendar
+  // days forward, for one contract or a book of them on the same
+  // underlying. Each (vol, days) slice builds market objects once per
+  // distinct volatility and shares them across the book; every non-European
+  // contract gets one FD solve per slice whose mesh covers every spot shift,
+  // and Europeans use the closed form. Slices run in parallel. Discounting
+  // is on riskFreeRate or on a loaded riskFreeCurve, read for every slice
+  // date and maturity in two batches up front.
+  std::string calcuateScenarioGrid(std::string data) {
+    try {
+      refuseWhileSuspended();
+      arenaScope scope;
+      json request = json::parse(data);
+
+      refuseGridFields(request);
+      const Date todaysDate = DateParser::parseISO(request.at("todaysDate").get<std::string>());
+      const Date settlementDate = DateParser::parseISO(request.at("settlementDate").get<std::string>());
+      const double underlying = request.at("underlying");
+      ext::shared_ptr<pillarCurve> riskFreeCurve;
+      double riskFreeRate = 0.0;
+      if (request.contains("riskFreeCurve")) {
+        QL_REQUIRE(!request.contains("riskFreeRate"), "give either riskFreeRate or riskFreeCurve, not both");
+        riskFreeCurve = findYieldCurve(request["riskFreeCurve"].get<std::string>(), todaysDate).curve;
+      } else {
+        riskFreeRate = request.at("riskFreeRate");
+      }
+      const double dividendYield = request.at("dividendYield");
+      const Size timeSteps = request.value("timeSteps", 201);
+
+      std::vector<gridContract> contracts;
+      if (request.contains("contracts")) {
+        QL_REQUIRE(request["contracts"].is_array() && !request["contracts"].empty(),
+                   "contracts must be a non-empty array");
+        for (const json &entry : request["contracts"]) {
+          refuseGridFields(entry);
+          QL_REQUIRE(!entry.contains("riskFreeCurve"), "contracts take the request's riskFreeCurve");
+          contracts.push_back(parseGridContract(entry));
+        }
+      } else {
+        contracts.push_back(parseGridContract(request));
+      }
+
+      const std::vector<double> spotShifts = request.value("spotShifts", std::vector<double>(1, 0.0));
+      const std::vector<double> volShifts = request.value("volShifts", std::vector<double>(1, 0.0));
+      const std::vector<int> daysForward = request.value("daysForward", std::vector<int>(1, 0));
+      const bool withDelta = request.value("delta", false);
+
+      const Size nSpot = spotShifts.size(), nVol = volShifts.size(), nDays = daysForward.size();
+      QL_REQUIRE(nSpot > 0 && nVol > 0 && nDays > 0, "scenario shifts must not be empty");
+
+      std::vector<double> spots(nSpot);
+      for (Size i = 0; i < nSpot; i++) {
+        spots[i] = underlying * (1.0 + spotShifts[i]);
+        QL_REQUIRE(spots[i] > 0.0, "spot shift " << spotShifts[i] << " gives a non-positive spot");
+      }
+      const double minSpot = *std::min_element(spots.begin(), spots.end());
+      const double maxSpot = *std::max_element(spots.begin(), spots.end());
+
+      // Discount factors from todaysDate; a slice discounts a maturity by
+      // the ratio of the two.
+      auto discountTable = [&](const std::vector<Date> &dates) {
+        std::vector<Time> times(dates.size());
+        for (Size i = 0; i < dates.size(); i++)
+          times[i] = Real(dates[i] - todaysDate) / 365.0;
+        std::vector<DiscountFactor> factors(dates.size());
+        if (riskFreeCurve)
+          riskFreeCurve->discounts(times.data(), factors.data(), times.size());
+        else
+          for (Size i = 0; i < times.size(); i++)
+            factors[i] = std::exp(-riskFreeRate * times[i]);
+        return factors;
+      };
+      std::vector<Date> sliceDates(nDays), maturityDates(contracts.size());
+      for (Size d = 0; d < nDays; d++)
+        sliceDates[d] = settlementDate + daysForward[d];
+      for (Size c = 0; c < contracts.size(); c++)
+        maturityDates[c] = contracts[c].maturityDate;
+      const std::vector<DiscountFactor> sliceDiscounts = discountTable(sliceDates);
+      const std::vector<DiscountFactor> maturityDiscounts = discountTable(maturityDates);
+
+      pricingContext context(todaysDate);
+
+      std::vector<double> npv(nSpot * nVol * nDays, 0.0), delta(withDelta ? npv.size() : 0, 0.0);
+      auto cell = [&](Size s, Size v, Size d) { return (s * nVol + v) * nDays + d; };
+
+      parallelFor(nVol * nDays, [&](Size slice) {
+        const Size v = slice / nDays, d = slice % nDays;
+        const Date referenceDate = sliceDates[d];
+        DayCounter dayCounter = Actual365Fixed();
+        std::map<double, marketObjects> markets;
+
+        for (Size c = 0; c < contracts.size(); c++) {
+          const gridContract &contract = contracts[c];
+          const double volatility = contract.volatility + volShifts[v];
+          QL_REQUIRE(volatility > 0.0, "vol shift " << volShifts[v] << " gives a non-positive volatility");
+          QL_REQUIRE(referenceDate < contract.maturityDate,
+                     daysForward[d] << " days forward is past maturity " << isoDate(contract.maturityDate));
+          const Time maturity = dayCounter.yearFraction(referenceDate, contract.maturityDate);
+
+          if (contract.executionStyle == 0) {
+            const double discount = maturityDiscounts[c] / sliceDiscounts[d];
+            const double stdDev = volatility * std::sqrt(maturity);
+            for (Size s = 0; s < nSpot; s++) {
+              const double forward = spots[s] * std::exp(-dividendYield * maturity) / discount;
+              BlackCalculator black(contract.type, contract.strike, forward, stdDev, discount);
+              npv[cell(s, v, d)] += contract.quantity * black.value();
+              if (withDelta)
+                delta[cell(s, v, d)] += contract.quantity * black.delta(spots[s]);
+            }
+            continue;
+          }
+
+          auto market = markets.find(volatility);
+          if (market == markets.end())
+            market = markets.insert(std::make_pair(volatility, makeMarketObjects(
+              referenceDate, underlying, volatility, riskFreeRate, dividendYield, riskFreeCurve))).first;
+
+          ext::shared_ptr<Exercise> exercise;
+          if (contract.executionStyle == 2) {
+            std::vector<Date> exerciseDates;
+            for (auto &date : makeExercise(2, settlementDate, contract.maturityDate)->dates())
+              if (date > referenceDate)
+                exerciseDates.push_back(date);
+            QL_REQUIRE(!exerciseDates.empty(),
+                       daysForward[d] << " days forward is past the last exercise date");
+            exercise = makeShared<BermudanExercise>(exerciseDates);
+          } else {
+            exercise = makeExercise(contract.executionStyle, referenceDate, contract.maturityDate);
+          }
+
+          const double width = 1.5 * 3.72 * volatility
+            * std::sqrt(dayCounter.yearFraction(referenceDate, exercise->lastDate()));
+
+          ext::shared_ptr<FdmBlackScholesSolver> solver = makeFdSolver(
+            market->second.bsmProcess,
+            makeShared<PlainVanillaPayoff>(contract.type, contract.strike),
+            exercise,
+            std::log(minSpot) - width,
+            std::log(maxSpot) + width,
+            timeSteps);
+
+          for (Size s = 0; s < nSpot; s++) {
+            npv[cell(s, v, d)] += contract.quantity * solver->valueAt(spots[s]);
+            if (withDelta)
+              delta[cell(s, v, d)] += contract.quantity * solver->deltaAt(spots[s]);
+          }
+        }
+      });
+
+      json npvCube = json::array(), deltaCube = json::array();
+      for (Size s = 0; s < nSpot; s++) {
+        json npvPlane = json::array(), deltaPlane = json::array();
+        for (Size v = 0; v < nVol; v++) {
+          npvPlane.push_back(std::vector<double>(npv.begin() + cell(s, v, 0), npv.begin() + cell(s, v, 0) + nDays));
+          if (withDelta)
+            deltaPlane.push_back(std::vector<double>(delta.begin() + cell(s, v, 0), delta.begin() + cell(s, v, 0) + nDays));
+        }
+        npvCube.push_back(npvPlane);
+        if (withDelta)
+          deltaCube.push_back(deltaPlane);
+      }
+
+      request["spots"] = spots;
+      request["NPV"] = npvCube;
+      if (withDelta)
+        request["delta"] = deltaCube;
+
+      return request.dump();
+    }
+
+    catch (std::exception &e) { return e.what(); }
+    catch (...) { return "unknown error"; }
+  };
+
+  // Book-level risk. Each underlying owns one set of quotes, curves and
+  // processes, built on its first position and shared by all of its expiry
+  // groups, plus one engine per (volatility, engine). Underlyings share no
+  // observables, so they are priced on separate threads; positions on one
+  // underlying are priced on the same thread because bumping its quotes
+  // moves every one of them. Instruments are built and destroyed on the
+  // calling thread because constructing an Instrument registers it with the
+  // global evaluation date. Results are reduced straight into per-underlying
+  // totals, so nothing is allocated per position during pricing.
+  std::string calcuatePortfolio(std::string data) {
+    try {
+      refuseWhileSuspended();
+      arenaScope scope;
+      json request = json::parse(data);
+
+      Date todaysDate = DateParser::parseISO(request.at("todaysDate").get<std::string>());
+      Date settlementDate = DateParser::parseISO(request.at("settlementDate").get<std::string>());
+      Size timeSteps = request.value("timeSteps", 101);
+      std::string latticeEngine = request.value("engine", std::string("Finite-Differences"));
+
+      pricingContext context(todaysDate);
+
+      const json &underlyings = request.at("underlyings");
+      std::vector<std::string> names;
+      std::map<std::string, Size> underlyingIndex;
+      for (auto it = underlyings.begin(); it != underlyings.end(); ++it) {
+        underlyingIndex[it.key()] = names.size();
+        names.push_back(it.key());
+      }
+
+      struct portfolioPosition {
+        ext::shared_ptr<VanillaOption> option;
+        Size market;
+        double weight;
+        bool analytic;
+      };
+
+      struct portfolioBook {
+        std::vector<marketObjects> markets;
+        std::map<double, Size> marketByVolatility;
+        std::map<std::pair<Size, std::string>, ext::shared_ptr<PricingEngine> > engines;
+        std::set<Date> expiries;
+        std::vector<portfolioPosition> positions;
+        optionGreeks total;
+      };
+
+      std::vector<portfolioBook> books(names.size());
+
+      for (auto &p : request.at("positions")) {
+        auto u = underlyingIndex.find(p.at("underlying").get<std::string>());
+        QL_REQUIRE(u != underlyingIndex.end(),
+                   "no market data for underlying " << p.at("underlying").get<std::string>());
+        const json &market = underlyings[u->first];
+        portfolioBook &book = books[u->second];
+
+        Date maturityDate = DateParser::parseISO(p.at("maturityDate").get<std::string>());
+        double volatility = p.at("optionPrice");
+        int executionStyle = p.at("executionStyle").get<int>();
+
+        if (book.markets.empty()) {
+          book.markets.push_back(
+            makeMarketObjects(
+              settlementDate,
+              market.at("underlying"),
+              volatility,
+              market.value("riskFreeRate", request.value("riskFreeRate", 0.0)),
+              market.value("dividendYield", 0.0)));
+          book.marketByVolatility[volatility] = 0;
+        }
+        book.expiries.insert(maturityDate);
+
+        auto m = book.marketByVolatility.find(volatility);
+        if (m == book.marketByVolatility.end()) {
+          book.markets.push_back(withVolatility(book.markets.front(), volatility));
+          m = book.marketByVolatility.insert(std::make_pair(volatility, book.markets.size() - 1)).first;
+        }
+
+        std::string engine = executionStyle == 0 ? std::string("Black-Scholes") : latticeEngine;
+        ext::shared_ptr<PricingEngine> &pricingEngine = book.engines[std::make_pair(m->second, engine)];
+        if (!pricingEngine)
+          pricingEngine = makeEngine(engine, book.markets[m->second].bsmProcess, timeSteps);
+
+        portfolioPosition position;
+        position.option = makeShared<VanillaOption>(
+          makeShared<PlainVanillaPayoff>(Option::Type(p.at("optionType").get<int>()), p.at("strike").get<double>()),
+          makeExercise(executionStyle, settlementDate, maturityDate));
+        position.option->setPricingEngine(pricingEngine);
+        position.market = m->second;
+        position.weight = p.value("quantity", 1.0) * p.value("multiplier", 1.0);
+        position.analytic = engine == "Black-Scholes";
+        book.positions.push_back(position);
+      }
+
+      parallelFor(books.size(), [&](Size b) {
+        portfolioBook &book = books[b];
+        if (book.positions.empty())
+          return;
+        std::vector<double> baseNPV(book.positions.size());
+        const double volatilityBump = 1.0e-4, rateBump = 1.0e-4;
+
+        for (Size i = 0; i < book.positions.size(); i++) {
+          const portfolioPosition &position = book.positions[i];
+          optionGreeks greeks;
+          greeks.NPV = baseNPV[i] = position.option->NPV();
+          greeks.delta = position.option->delta();
+          greeks.gamma = position.option->gamma();
+          greeks.theta = position.option->theta();
+          if (position.analytic) {
+            greeks.vega = position.option->vega();
+            greeks.rho = position.option->rho();
+          }
+          addWeighted(book.total, greeks, position.weight);
+        }
+
+        for (Size m = 0; m < book.markets.size(); m++) {
+          book.markets[m].volatility->setValue(book.markets[m].volatility->value() + volatilityBump);
+          for (Size i = 0; i < book.positions.size(); i++)
+            if (book.positions[i].market == m && !book.positions[i].analytic)
+              book.total.vega += book.positions[i].weight
+                * (book.positions[i].option->NPV() - baseNPV[i]) / volatilityBump;
+          book.markets[m].volatility->setValue(book.markets[m].volatility->value() - volatilityBump);
+        }
+
+        ext::shared_ptr<SimpleQuote> riskFreeRate = book.markets.front().riskFreeRate;
+        riskFreeRate->setValue(riskFreeRate->value() + rateBump);
+        for (Size i = 0; i < book.positions.size(); i++)
+          if (!book.positions[i].analytic)
+            book.total.rho += book.positions[i].weight
+              * (book.positions[i].option->NPV() - baseNPV[i]) / rateBump;
+        riskFreeRate->setValue(riskFreeRate->value() - rateBump);
+      });
+
+      optionGreeks total;
+      Size groups = 0;
+      for (auto &book : books) {
+        addWeighted(total, book.total, 1.0);
+        groups += book.expiries.size();
+      }
+
+      json response;
+      for (Size u = 0; u < names.size(); u++)
+        response["underlyings"][names[u]] = greeksToJson(books[u].total);
+      response["total"] = greeksToJson(total);
+      response["positions"] = request.at("positions").size();
+      response["groups"] = groups;
+
+      return response.dump();
+    }
+
+    catch (std::exception &e) { return e.what(); }
+    catch (...) { return "unknown error"; }
+  };
+}
+
+namespace
+{
+#ifdef __EMSCRIPTEN__
+  // Uint8Array in, Uint8Array out. The reply is copied out of the wasm heap
+  // so it stays valid after the vector is freed.
+  val toUint8Array(const std::vector<std::uint8_t> &bytes){
+    return val::global("Uint8Array").new_(typed_memory_view(bytes.size(), bytes.data()));
+  };
+
+  val calcuateOptionCBORBytes(val bytes){
+    return toUint8Array(calcuateOptionCBOR(convertJSArrayToNumberVector<std::uint8_t>(bytes)));
+  };
+
+  val calcuateOptionMsgPackBytes(val bytes){
+    return toUint8Array(calcuateOptionMsgPack(convertJSArrayToNumberVector<std::uint8_t>(bytes)));
+  };
+
+  // callback is called with each response text as it is emitted.
+  std::string calcuateOptionStreamingJS(std::string data, val callback){
+    return calcuateOptionStreaming(data, [&](const std::string &text) { callback(text); });
+  };
+#endif
+
+#ifdef __EMSCRIPTEN__
+  EMSCRIPTEN_BINDINGS(quantlib) {
+    emscripten::function("calcuateOption", &calcuateOption);
+    emscripten::function("calcuateStrategy", &calcuateStrategy);
+    emscripten::function("calcuateScenarioGrid", &calcuateScenarioGrid);
+    emscripten::function("calcuatePortfolio", &calcuatePortfolio);
+    emscripten::function("setCacheCapacity", &setCacheCapacity);
+    emscripten::function("getCacheStats", &getCacheStats);
+    emscripten::function("getMetrics", &getMetrics);
+    emscripten::function("getMemoryStats", &getMemoryStats);
+    emscripten::function("setRequestMemoryLimit", &setRequestMemoryLimit);
+    emscripten::function("setOneShotPricing", &setOneShotPricing);
+    emscripten::function("cancel", &cancel);
+    emscripten::function("loadYieldCurve", &loadYieldCurve);
+    emscripten::function("warmUp", &warmUp);
+    emscripten::function("calcuateOptionStreaming", &calcuateOptionStreamingJS);
+#ifdef OPTIONS_ASYNCIFY
+    emscripten::function("calcuateOptionAsync", &calcuateOptionAsync, emscripten::async());
+#endif
+    emscripten::function("calcuateOptionCBOR", &calcuateOptionCBORBytes);
+    emscripten::function("calcuateOptionMsgPack", &calcuateOptionMsgPackBytes);
+  }
+#endif
 }